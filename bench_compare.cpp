@@ -0,0 +1,123 @@
+#include "bench_stats.h"
+#include "tjson.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+// Compares two `bench_json --json` reports, exiting nonzero if any case's
+// median got slower by more than the threshold, with non-overlapping 95%
+// confidence intervals for the medians.
+
+static std::unique_ptr<tjson::Val>
+ReadReport(const char* const path)
+{
+   std::ifstream in(path, std::ios_base::in | std::ios_base::binary);
+   std::ostringstream ss;
+   ss << in.rdbuf();
+   const auto bytes = ss.str();
+   if (!in || bytes.empty()) {
+      fprintf(stderr, "Can't read %s\n", path);
+      return nullptr;
+   }
+
+   std::string err;
+   auto ret = tjson::read(bytes.data(), bytes.data() + bytes.size(), &err);
+   if (!ret) {
+      fprintf(stderr, "%s: %s\n", path, err.c_str());
+   }
+   return ret;
+}
+
+static std::vector<double>
+Samples(const tjson::Val& entry)
+{
+   std::vector<double> ret;
+   for (const auto& v : entry["mb_per_s_samples"].list()) {
+      double x;
+      if (v->as_number(&x)) {
+         ret.push_back(x);
+      }
+   }
+   return ret;
+}
+
+int
+main(int argc, const char* const argv[])
+{
+   double threshold = 0.05;
+   std::vector<const char*> paths;
+   for (int i = 1; i < argc; ++i) {
+      const std::string arg = argv[i];
+      if (arg == "--threshold" && i + 1 < argc) {
+         const auto str = argv[++i];
+         char* end;
+         threshold = strtod(str, &end);
+         if (end == str || *end || !(threshold >= 0)) {
+            paths.clear();
+            break;
+         }
+      } else if (arg.compare(0, 2, "--")) {
+         paths.push_back(argv[i]);
+      } else {
+         paths.clear();
+         break;
+      }
+   }
+   if (paths.size() != 2) {
+      fprintf(stderr, "Usage: %s [--threshold FRACTION] BASE.json NEW.json\n",
+              argv[0]);
+      return 2;
+   }
+
+   const auto base_doc = ReadReport(paths[0]);
+   const auto next_doc = ReadReport(paths[1]);
+   if (!base_doc || !next_doc)
+      return 2;
+   const tjson::Val& base = *base_doc;
+   const tjson::Val& next = *next_doc;
+
+   std::vector<std::string> names;
+   for (const auto& kv : base["cases"].dict()) {
+      names.push_back(kv.first);
+   }
+   std::sort(names.begin(), names.end());
+
+   size_t regression_count = 0;
+   for (const auto& name : names) {
+      const auto& base_entry = base["cases"][name];
+      const auto& next_entry = next["cases"][name];
+      if (!next_entry) {
+         printf("%-10s missing from %s\n", name.c_str(), paths[1]);
+         continue;
+      }
+
+      const auto base_samples = Samples(base_entry);
+      const auto next_samples = Samples(next_entry);
+      const auto base_median = Median(base_samples);
+      const auto next_median = Median(next_samples);
+      double base_low, base_high, next_low, next_high;
+      MedianInterval95(base_samples, &base_low, &base_high);
+      MedianInterval95(next_samples, &next_low, &next_high);
+
+      const auto change = (base_median ? next_median / base_median - 1 : 0);
+      const char* verdict = "";
+      if (next_high < base_low || next_low > base_high) {
+         if (change < -threshold) {
+            verdict = "REGRESSION";
+            regression_count += 1;
+         } else if (change > threshold) {
+            verdict = "improvement";
+         }
+      }
+      printf("%-10s %10.2f -> %10.2f MB/s  %+6.1f%%  %s\n", name.c_str(),
+             base_median, next_median, change * 100, verdict);
+   }
+
+   if (regression_count) {
+      printf("%zu regression(s) beyond %.1f%%.\n", regression_count,
+             threshold * 100);
+      return 1;
+   }
+   return 0;
+}
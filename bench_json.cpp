@@ -0,0 +1,653 @@
+#include "bench_stats.h"
+#include "tjson.h"
+#include "tjson_fields.h"
+#include "tjson_kernels.h"
+#include "tjson_tape.h"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <sstream>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Hardware counters for the calling thread, read as one perf_event group so
+// they all cover the same interval.
+class PerfCounters final
+{
+public:
+   static const size_t COUNT = 4;
+   static const char* const NAMES[COUNT];
+
+private:
+   int fds_[COUNT] = {-1, -1, -1, -1};
+
+public:
+   // Returns false if perf events aren't available, e.g. without Linux, or
+   // with a restrictive perf_event_paranoid.
+   bool Open() {
+#ifdef __linux__
+      const uint64_t configs[COUNT] = {
+         PERF_COUNT_HW_CPU_CYCLES,
+         PERF_COUNT_HW_INSTRUCTIONS,
+         PERF_COUNT_HW_BRANCH_MISSES,
+         PERF_COUNT_HW_CACHE_MISSES,
+      };
+      for (size_t i = 0; i < COUNT; ++i) {
+         perf_event_attr attr;
+         memset(&attr, 0, sizeof(attr));
+         attr.size = sizeof(attr);
+         attr.type = PERF_TYPE_HARDWARE;
+         attr.config = configs[i];
+         attr.disabled = (i == 0); // The group follows its leader.
+         attr.exclude_kernel = 1;
+         attr.exclude_hv = 1;
+         attr.read_format = PERF_FORMAT_GROUP;
+         fds_[i] = int(syscall(__NR_perf_event_open, &attr, 0, -1,
+                               (i ? fds_[0] : -1), 0));
+         if (fds_[i] == -1) {
+            Close();
+            return false;
+         }
+      }
+      return true;
+#else
+      return false;
+#endif
+   }
+
+   ~PerfCounters() { Close(); }
+
+   void Close() {
+#ifdef __linux__
+      for (auto& fd : fds_) {
+         if (fd != -1) {
+            close(fd);
+         }
+         fd = -1;
+      }
+#endif
+   }
+
+   bool IsOpen() const { return fds_[0] != -1; }
+
+   void Start() {
+#ifdef __linux__
+      ioctl(fds_[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+      ioctl(fds_[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+   }
+
+   bool Stop(uint64_t (* const out)[COUNT]) {
+#ifdef __linux__
+      ioctl(fds_[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+      uint64_t buf[1 + COUNT];
+      if (read(fds_[0], buf, sizeof(buf)) != sizeof(buf) || buf[0] != COUNT)
+         return false;
+      memcpy(*out, buf + 1, sizeof(*out));
+      return true;
+#else
+      return false;
+#endif
+   }
+};
+
+/*static*/ const char* const PerfCounters::NAMES[COUNT] = {
+   "cycles",
+   "instructions",
+   "branch_misses",
+   "cache_misses",
+};
+
+// -
+
+struct Case final
+{
+   const char* name;
+   // Runs one iteration, returning how many bytes it processed.
+   std::function<uint64_t()> fn_run;
+};
+
+struct CaseResult final
+{
+   uint64_t iterations = 0;
+   uint64_t bytes = 0;
+   double secs = 0;
+   bool has_counters = false;
+   uint64_t counters[PerfCounters::COUNT] = {};
+};
+
+// Repeats `c` for at least `min_secs`, counting the whole timed span, as one
+// sample.
+static CaseResult
+RunCase(const Case& c, const double min_secs, PerfCounters* const perf)
+{
+   (void)c.fn_run(); // Warm up.
+
+   CaseResult ret;
+   const auto start = std::chrono::steady_clock::now();
+   if (perf) {
+      perf->Start();
+   }
+   while (ret.secs < min_secs) {
+      ret.bytes += c.fn_run();
+      ret.iterations += 1;
+      ret.secs = std::chrono::duration<double>(
+         std::chrono::steady_clock::now() - start).count();
+   }
+   if (perf) {
+      ret.has_counters = perf->Stop(&ret.counters);
+   }
+   return ret;
+}
+
+// -
+// Under --check-allocs, every global operator new in this program is counted,
+// so it can assert that paths meant to be allocation-free stay that way.
+// Otherwise, the benchmarks only pay for a predictable branch.
+
+static bool gCountAllocs = false; // Set once, before any threads start.
+static std::atomic<uint64_t> gAllocCount(0);
+
+// All of operator new and delete go through this out-of-line pair, so GCC
+// never sees new'd memory passed straight to free() (-Wmismatched-new-delete).
+__attribute__((noinline)) static void*
+CountedAlloc(const size_t size) noexcept
+{
+   if (gCountAllocs) {
+      gAllocCount.fetch_add(1, std::memory_order_relaxed);
+   }
+   return malloc(size ? size : 1);
+}
+
+__attribute__((noinline)) static void
+CountedFree(void* const p) noexcept
+{
+   free(p);
+}
+
+void*
+operator new(const size_t size)
+{
+   if (const auto ret = CountedAlloc(size))
+      return ret;
+   throw std::bad_alloc();
+}
+
+void*
+operator new[](const size_t size)
+{
+   return operator new(size);
+}
+
+void*
+operator new(const size_t size, const std::nothrow_t&) noexcept
+{
+   return CountedAlloc(size);
+}
+
+void*
+operator new[](const size_t size, const std::nothrow_t&) noexcept
+{
+   return CountedAlloc(size);
+}
+
+void operator delete(void* const p) noexcept { CountedFree(p); }
+void operator delete[](void* const p) noexcept { CountedFree(p); }
+void operator delete(void* const p, size_t) noexcept { CountedFree(p); }
+void operator delete[](void* const p, size_t) noexcept { CountedFree(p); }
+
+// Each check runs once to warm up any reused buffers, then must not allocate
+// on the second run.
+static bool
+CheckAllocs(const std::string& bytes, const tjson::Val& doc)
+{
+   const auto begin = bytes.data();
+   const auto end = bytes.data() + bytes.size();
+   std::string err;
+
+   // Every const lookup that finds something in `doc`.
+   std::vector<std::pair<const tjson::Val*, std::string>> key_lookups;
+   std::vector<std::pair<const tjson::Val*, size_t>> index_lookups;
+   std::vector<const tjson::Val*> pending = {&doc};
+   while (pending.size()) {
+      const auto cur = pending.back();
+      pending.pop_back();
+      for (const auto& kv : cur->dict()) {
+         key_lookups.push_back({cur, kv.first});
+         pending.push_back(kv.second.get());
+      }
+      for (size_t i = 0; i < cur->list().size(); ++i) {
+         index_lookups.push_back({cur, i});
+         pending.push_back(cur->list()[i].get());
+      }
+   }
+
+   tjson::Tape tape;
+   std::string write_buf;
+   volatile uint64_t sink = 0;
+
+   const std::vector<Case> checks = {
+      {"Tape::parse (reused)", [&]() {
+         sink += tape.parse(begin, end, &err);
+         return 0;
+      }},
+      {"validate", [&]() {
+         sink += tjson::validate(begin, end, &err);
+         return 0;
+      }},
+      {"const Val::operator[]", [&]() {
+         for (const auto& lookup : key_lookups) {
+            sink += !!(*lookup.first)[lookup.second];
+         }
+         for (const auto& lookup : index_lookups) {
+            sink += !!(*lookup.first)[lookup.second];
+         }
+         return 0;
+      }},
+      {"write (reused buffer)", [&]() {
+         write_buf.clear();
+         doc.write(&write_buf, "");
+         return 0;
+      }},
+   };
+
+   bool ok = true;
+   for (const auto& check : checks) {
+      (void)check.fn_run();
+      const auto before = gAllocCount.load();
+      (void)check.fn_run();
+      const auto count = gAllocCount.load() - before;
+      fprintf(stderr, "%-24s %llu allocations\n", check.name,
+              (unsigned long long)count);
+      if (count) {
+         ok = false;
+      }
+   }
+
+   // Reader::read must allocate the tree, but nothing more: one per node, one
+   // per dict member, one per string too long to store inline, and each
+   // container's own growth, which is geometric.
+   const auto inline_size = std::string().capacity();
+   uint64_t expected = 0;
+   pending = {&doc};
+   while (pending.size()) {
+      const auto cur = pending.back();
+      pending.pop_back();
+      expected += 1;
+      expected += (cur->val().size() > inline_size);
+      for (const auto& kv : cur->dict()) {
+         expected += 1 + (kv.first.size() > inline_size);
+         pending.push_back(kv.second.get());
+      }
+      for (const auto& child : cur->list()) {
+         pending.push_back(child.get());
+      }
+      for (auto n = cur->dict().size() + cur->list().size(); n; n >>= 1) {
+         expected += 1;
+      }
+      expected += (cur->dict().size() != 0); // Buckets start out inline.
+   }
+   tjson::Reader reader;
+   (void)reader.read(begin, end, &err);
+   const auto before = gAllocCount.load();
+   const auto read_doc = reader.read(begin, end, &err);
+   const auto count = gAllocCount.load() - before;
+   fprintf(stderr, "%-24s %llu allocations (at most %llu)\n", "Reader::read",
+           (unsigned long long)count, (unsigned long long)expected);
+
+   if (!ok) {
+      fprintf(stderr, "FAILED: Expected no allocations.\n");
+   }
+   if (!read_doc || count > expected) {
+      fprintf(stderr, "FAILED: Expected at most %llu allocations to read.\n",
+              (unsigned long long)expected);
+      ok = false;
+   }
+   return ok;
+}
+
+// -
+
+// Converts one document through get_if() to every type get_value() supports,
+// so each of those templates is instantiated and checked on every build.
+static bool
+CheckConversions()
+{
+   const std::string text = R"({
+      "bool": true, "null": null, "int": -7, "big": 300, "frac": 1.5,
+      "str": "a\"b", "bools": [true, false, true], "ints": [1, 2, 3],
+      "nested": [[1], [], [2, 3]], "dict": {"x": 1.5, "y": -2}
+   })";
+   std::string err;
+   const auto doc = tjson::read(text.data(), text.data() + text.size(), &err);
+   if (!doc) {
+      fprintf(stderr, "%s\n", err.c_str());
+      return false;
+   }
+   const auto& v = *doc;
+
+   bool b = false;
+   std::nullptr_t n;
+   int64_t i64 = 0;
+   uint64_t u64 = 0;
+   int i = 0;
+   uint8_t u8 = 0;
+   double d = 0;
+   float f = 0;
+   std::string s;
+   std::vector<bool> bools;
+   std::vector<int> ints;
+   std::vector<std::vector<uint16_t>> nested;
+   std::unordered_map<std::string, double> dict;
+   std::unordered_map<std::string, int> int_dict;
+
+   const bool checks[] = {
+      v["bool"].get_if(&b) && b,
+      v["null"].get_if(&n),
+      v["int"].get_if(&i64) && i64 == -7,
+      !v["int"].get_if(&u64) && v["big"].get_if(&u64) && u64 == 300,
+      v["int"].get_if(&i) && i == -7 && !v["frac"].get_if(&i),
+      !v["big"].get_if(&u8),
+      v["frac"].get_if(&d) && d == 1.5,
+      v["frac"].get_if(&f) && f == 1.5f,
+      v["str"].get_if(&s) && s == "a\"b",
+      v["bools"].get_if(&bools) && bools == std::vector<bool>{true, false, true},
+      v["ints"].get_if(&ints) && ints == std::vector<int>{1, 2, 3},
+      !v["bools"].get_if(&ints) && ints.size() == 3, // Left alone.
+      v["nested"].get_if(&nested) && nested.size() == 3 &&
+         nested[2] == std::vector<uint16_t>{2, 3},
+      v["dict"].get_if(&dict) && dict.size() == 2 && dict["y"] == -2,
+      !v["dict"].get_if(&int_dict),
+      v["missing"].get<std::string>().empty(),
+      v["missing"].value_or<int>(5) == 5,
+   };
+   bool ok = true;
+   for (size_t j = 0; j < sizeof(checks) / sizeof(checks[0]); ++j) {
+      if (!checks[j]) {
+         fprintf(stderr, "FAILED: Conversion check %zu.\n", j + 1);
+         ok = false;
+      }
+   }
+   return ok;
+}
+
+// -
+
+// Collects the raw text of every scalar in `val`.
+static void
+CollectScalars(const tjson::Val& val, std::vector<std::string>* const out_strings,
+               std::vector<const tjson::Val*>* const out_words)
+{
+   for (const auto& kv : val.dict()) {
+      out_strings->push_back(tjson::escape(kv.first));
+      CollectScalars(*kv.second, out_strings, out_words);
+   }
+   for (const auto& v : val.list()) {
+      CollectScalars(*v, out_strings, out_words);
+   }
+   if (val.is_val()) {
+      if (val.val()[0] == '"') {
+         out_strings->push_back(val.val());
+      } else {
+         out_words->push_back(&val);
+      }
+   }
+}
+
+// Field binding needs a schema, so borrow one from `doc`: the keys of the
+// top-level dict, or of the first item of a top-level list.
+static const tjson::Val*
+SchemaDict(const tjson::Val& doc)
+{
+   if (doc.is_list() && doc.list().size())
+      return SchemaDict(*doc.list()[0]);
+   return (doc.is_dict() ? &doc : nullptr);
+}
+
+int
+main(int argc, const char* const argv[])
+{
+   const char* path = "test.json";
+   bool use_perf = false;
+   bool json = false;
+   bool check_allocs = false;
+   double min_secs = 0.2;
+   size_t runs = 5;
+   const auto fn_usage = [&]() {
+      fprintf(stderr, "Usage: %s [--perf] [--json] [--min-secs SECS] [--runs N]"
+              " [--check-allocs] [PATH]\n",
+              argv[0]);
+      return 1;
+   };
+   for (int i = 1; i < argc; ++i) {
+      const std::string arg = argv[i];
+      if (arg == "--perf") {
+         use_perf = true;
+      } else if (arg == "--json") {
+         json = true;
+      } else if (arg == "--check-allocs") {
+         check_allocs = true;
+      } else if (arg == "--min-secs" && i + 1 < argc) {
+         const auto str = argv[++i];
+         char* end;
+         min_secs = strtod(str, &end);
+         if (end == str || *end || !(min_secs >= 0))
+            return fn_usage();
+      } else if (arg == "--runs" && i + 1 < argc) {
+         const auto str = argv[++i];
+         char* end;
+         errno = 0;
+         runs = strtoul(str, &end, 10);
+         if (end == str || *end || errno || !runs)
+            return fn_usage();
+      } else if (arg.compare(0, 2, "--")) {
+         path = argv[i];
+      } else {
+         return fn_usage();
+      }
+   }
+
+   std::string bytes;
+   {
+      std::ifstream in(path, std::ios_base::in | std::ios_base::binary);
+      std::ostringstream ss;
+      ss << in.rdbuf();
+      bytes = ss.str();
+      if (!in || bytes.empty()) {
+         fprintf(stderr, "Can't read %s\n", path);
+         return 1;
+      }
+   }
+
+   std::string err;
+   const auto doc = tjson::read(bytes.data(), bytes.data() + bytes.size(), &err);
+   if (!doc) {
+      fprintf(stderr, "%s\n", err.c_str());
+      return 1;
+   }
+
+   if (check_allocs) {
+      gCountAllocs = true;
+      return CheckAllocs(bytes, *doc) && CheckConversions() ? 0 : 1;
+   }
+
+   std::vector<std::string> escaped;
+   std::vector<const tjson::Val*> words;
+   CollectScalars(*doc, &escaped, &words);
+   std::vector<std::string> unescaped(escaped.size());
+   uint64_t escaped_bytes = 0;
+   uint64_t unescaped_bytes = 0;
+   for (size_t i = 0; i < escaped.size(); ++i) {
+      (void)tjson::unescape(escaped[i], &unescaped[i]);
+      escaped_bytes += escaped[i].size();
+      unescaped_bytes += unescaped[i].size();
+   }
+   uint64_t word_bytes = 0;
+   for (const auto& w : words) {
+      word_bytes += w->val().size();
+   }
+
+   // Strings and numbers in the schema are bound; anything else is skipped.
+   std::vector<std::string> field_keys;
+   std::vector<char> field_kinds;
+   if (const auto schema = SchemaDict(*doc)) {
+      for (const auto& kv : schema->dict()) {
+         field_keys.push_back(kv.first);
+         const auto& v = *kv.second;
+         field_kinds.push_back(!v.is_val() ? '?' : v.val()[0] == '"' ? 's' : 'n');
+      }
+   }
+   const tjson::KeyMatcher field_matcher(field_keys);
+
+   // Keep results observable so the work isn't optimized away.
+   volatile uint64_t sink = 0;
+
+   const std::vector<Case> cases = {
+      {"parse", [&]() {
+         const auto val = tjson::read(bytes.data(), bytes.data() + bytes.size(),
+                                      &err);
+         sink += bool(val);
+         return uint64_t(bytes.size());
+      }},
+      {"read_fields", [&]() {
+         std::string str;
+         double num;
+         const auto fn_field = [&](const size_t i, tjson::TokenGen* const gen,
+                                   std::string* const out_err) {
+            switch (field_kinds[i]) {
+            case 's':
+               return tjson::read_string(gen, &str, out_err);
+            case 'n':
+               return tjson::read_number(gen, &num, out_err);
+            }
+            return tjson::skip_value(gen, out_err);
+         };
+         const auto fn_item = [&](tjson::TokenGen* const gen,
+                                  std::string* const out_err) {
+            return tjson::read_fields(gen, field_matcher, fn_field, out_err);
+         };
+         tjson::TokenGen gen(bytes.data(), bytes.data() + bytes.size());
+         if (doc->is_list()) {
+            sink += tjson::read_items(&gen, fn_item, &err);
+         } else {
+            sink += fn_item(&gen, &err);
+         }
+         return uint64_t(bytes.size());
+      }},
+      {"write", [&]() {
+         std::ostringstream out;
+         doc->write(&out, "");
+         const auto size = uint64_t(out.tellp());
+         sink += size;
+         return size;
+      }},
+      {"write (sized)", [&]() {
+         std::string out;
+         doc->write(&out, "");
+         const auto size = uint64_t(out.size());
+         sink += size;
+         return size;
+      }},
+      {"escape", [&]() {
+         for (const auto& s : unescaped) {
+            sink += tjson::escape(s).size();
+         }
+         return unescaped_bytes;
+      }},
+      {"unescape", [&]() {
+         std::string out;
+         for (const auto& s : escaped) {
+            sink += tjson::unescape(s, &out);
+         }
+         return escaped_bytes;
+      }},
+      {"as_number", [&]() {
+         double d;
+         for (const auto& w : words) {
+            sink += w->as_number(&d);
+         }
+         return word_bytes;
+      }},
+   };
+
+   PerfCounters perf;
+   if (use_perf && !perf.Open()) {
+      fprintf(stderr, "perf_event_open unavailable; reporting time only.\n");
+   }
+
+   tjson::Val report;
+   report["input"]->val(path);
+   report["input_bytes"]->set_val(std::to_string(bytes.size()));
+   report["kernels"]->val(tjson::kernels().name);
+   if (!json) {
+      fprintf(stderr, "Using %s kernels.\n", tjson::kernels().name);
+   }
+   auto& report_cases = *report["cases"];
+
+   for (const auto& c : cases) {
+      // Each run is a sample, so comparisons can tell noise from change.
+      CaseResult total;
+      std::vector<double> samples;
+      for (size_t run = 0; run < runs; ++run) {
+         const auto res = RunCase(c, min_secs, perf.IsOpen() ? &perf : nullptr);
+         samples.push_back(double(res.bytes) / (1000*1000) / res.secs);
+
+         total.iterations += res.iterations;
+         total.bytes += res.bytes;
+         total.has_counters = res.has_counters;
+         for (size_t i = 0; i < PerfCounters::COUNT; ++i) {
+            total.counters[i] += res.counters[i];
+         }
+      }
+      const auto median = Median(samples);
+      double ci_low, ci_high;
+      MedianInterval95(samples, &ci_low, &ci_high);
+
+      auto& entry = *report_cases[c.name];
+      entry["iterations"]->set_val(std::to_string(total.iterations));
+      entry["bytes"]->set_val(std::to_string(total.bytes));
+      entry["mb_per_s"]->val(median);
+      entry["mb_per_s_ci95_low"]->val(ci_low);
+      entry["mb_per_s_ci95_high"]->val(ci_high);
+      auto& entry_samples = *entry["mb_per_s_samples"];
+      entry_samples.set_list();
+      for (size_t i = 0; i < samples.size(); ++i) {
+         entry_samples[i]->val(samples[i]);
+      }
+
+      if (!json) {
+         fprintf(stderr, "%-10s %10.2f MB/s (95%% CI %.2f-%.2f)", c.name, median,
+                 ci_low, ci_high);
+      }
+      if (total.has_counters) {
+         for (size_t i = 0; i < PerfCounters::COUNT; ++i) {
+            const auto per_byte = double(total.counters[i]) / total.bytes;
+            const auto name = std::string(PerfCounters::NAMES[i]) + "_per_byte";
+            entry[name]->val(per_byte);
+            if (!json) {
+               fprintf(stderr, "  %s %.3f", name.c_str(), per_byte);
+            }
+         }
+      }
+      if (!json) {
+         fprintf(stderr, "\n");
+      }
+   }
+
+   if (json) {
+      report.write(&std::cout, "");
+      std::cout << "\n";
+   }
+   return 0;
+}
@@ -0,0 +1,51 @@
+#ifndef BENCH_STATS_H
+#define BENCH_STATS_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Summary statistics shared by bench_json and bench_compare.
+
+inline double
+Median(std::vector<double> samples)
+{
+   if (samples.empty())
+      return 0;
+   std::sort(samples.begin(), samples.end());
+   const auto mid = samples.size() / 2;
+   if (samples.size() % 2)
+      return samples[mid];
+   return (samples[mid - 1] + samples[mid]) / 2;
+}
+
+// 95% confidence interval for the median, from order statistics, so it
+// makes no assumption about the distribution: The number of samples below
+// the true median is Binomial(n, 1/2), so the sorted samples j from either
+// end bound it unless j or fewer fall below, or above, which each have at
+// most a 2.5% chance. Under six samples, the full range is the best there is.
+inline void
+MedianInterval95(std::vector<double> samples, double* const out_low,
+                 double* const out_high)
+{
+   const auto n = samples.size();
+   if (!n) {
+      *out_low = *out_high = 0;
+      return;
+   }
+   std::sort(samples.begin(), samples.end());
+
+   size_t j = 0;
+   double at_most = 0; // P(at most k samples below the median)
+   for (size_t k = 0; k < n / 2; ++k) {
+      at_most += std::exp(std::lgamma(n + 1.0) - std::lgamma(k + 1.0) -
+                          std::lgamma(n - k + 1.0) - n * std::log(2.0));
+      if (at_most > 0.025)
+         break;
+      j = k;
+   }
+   *out_low = samples[j];
+   *out_high = samples[n - 1 - j];
+}
+
+#endif // BENCH_STATS_H
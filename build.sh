@@ -1,3 +1,9 @@
 mkdir out 2>/dev/null
-$CXX --std=c++14 rewrite_json.cpp tjson.cpp -o out/rewrite_json $@
+# -lrt is for shm_open() before glibc 2.17, and an empty stub after.
+$CXX --std=c++14 rewrite_json.cpp tjson.cpp tjson_kernels.cpp tjson_tape.cpp tjson_fields.cpp tjson_schema.cpp tjson_path.cpp -pthread -lrt -o out/rewrite_json $@
+$CXX --std=c++14 bench_json.cpp tjson.cpp tjson_kernels.cpp tjson_tape.cpp tjson_fields.cpp tjson_schema.cpp tjson_path.cpp -pthread -lrt -o out/bench_json $@
+$CXX --std=c++14 bench_compare.cpp tjson.cpp tjson_kernels.cpp tjson_tape.cpp tjson_fields.cpp tjson_schema.cpp tjson_path.cpp -pthread -lrt -o out/bench_compare $@
 
+# Fail the build if allocation-free paths start allocating, or if get_value()
+# conversions break.
+out/bench_json --check-allocs test.json
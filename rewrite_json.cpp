@@ -1,7 +1,27 @@
 #include "tjson.h"
+#include "tjson_fields.h"
+#include "tjson_path.h"
+#include "tjson_schema.h"
+#include "tjson_tape.h"
+#include "tjson_walk.h"
 
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <fstream>
 #include <iostream>
+#include <mutex>
+#include <thread>
 
 static std::vector<uint8_t>
 ReadStream(std::istream* const in, std::string* const out_err)
@@ -26,43 +46,746 @@ ReadStream(std::istream* const in, std::string* const out_err)
    }
 }
 
+// Takes the bytes in `*buf`, leaving it empty.
+typedef std::function<void(std::string* buf)> FlushFn;
+
+// A walk() or select() handler that re-emits tokens as they are read, in the
+// same layout as tjson::write() (or with no whitespace at all, if `minify`),
+// without building a tree. Memory use is bounded by nesting depth and token
+// size, and key order is kept. With `line_per_value`, each top-level value,
+// as select() passes them, ends its own line.
+class ReformatWriter final
+{
+   static const size_t FLUSH_SIZE = 1 << 16;
+
+   const FlushFn fn_flush_to_;
+   const bool minify_;
+   const bool line_per_value_;
+   std::string buf_;
+   std::string indent_;
+   std::vector<size_t> counts_; // Members so far, per open container.
+   std::vector<bool> is_dict_;
+
+   void Newline() {
+      if (!minify_) {
+         buf_ += '\n';
+         buf_ += indent_;
+      }
+   }
+
+   // Separates list items. Dict members are separated at their keys.
+   void BeginValue() {
+      if (is_dict_.empty() || is_dict_.back())
+         return;
+      if (counts_.back()++) {
+         buf_ += ',';
+      }
+      Newline();
+   }
+
+   void EndValue() {
+      if (is_dict_.empty() && line_per_value_) {
+         buf_ += '\n';
+      }
+   }
+
+   void Emit(const tjson::Token& tok) {
+      buf_.append(tok.begin, tok.end);
+      if (buf_.size() >= FLUSH_SIZE) {
+         Flush();
+      }
+   }
+
+public:
+   ReformatWriter(const FlushFn& fn_flush_to, const bool minify,
+                  const bool line_per_value)
+      : fn_flush_to_(fn_flush_to)
+      , minify_(minify)
+      , line_per_value_(line_per_value)
+   {
+      buf_.reserve(FLUSH_SIZE);
+   }
+
+   bool OnMatch(const tjson::Token&) { return true; }
+
+   bool OnOpen(const tjson::Token& tok) {
+      BeginValue();
+      Emit(tok);
+      counts_.push_back(0);
+      is_dict_.push_back(*tok.begin == '{');
+      indent_ += "   ";
+      return true;
+   }
+
+   bool OnKey(const tjson::Token& tok) {
+      if (counts_.back()++) {
+         buf_ += ',';
+      }
+      Newline();
+      Emit(tok);
+      buf_ += (minify_ ? ":" : ": ");
+      return true;
+   }
+
+   bool OnScalar(const tjson::Token& tok) {
+      BeginValue();
+      Emit(tok);
+      EndValue();
+      return true;
+   }
+
+   bool OnClose(const tjson::Token& tok) {
+      indent_.resize(indent_.size() - 3);
+      if (counts_.back()) {
+         Newline();
+      }
+      counts_.pop_back();
+      is_dict_.pop_back();
+      Emit(tok);
+      EndValue();
+      return true;
+   }
+
+   // Hands off what's buffered, keeping room for the next chunk.
+   void Flush() {
+      fn_flush_to_(&buf_);
+      buf_.reserve(FLUSH_SIZE);
+   }
+};
+
+// Reformats one value from `in` through a ReformatWriter, so the grammar is
+// checked by walk() alone.
+static bool
+Reformat(tjson::TokenStream* const in, const FlushFn& fn_flush_to,
+         const bool minify, std::string* const out_err)
+{
+   ReformatWriter writer(fn_flush_to, minify, false);
+   if (!tjson::walk(in, &writer, out_err))
+      return false;
+   writer.Flush();
+   return true;
+}
+
+// -
+
+// Bounded single-producer, single-consumer ring buffer. Each side spins
+// briefly while the queue is full or empty, then sleeps until the other side
+// pushes or pops, so an idle stage doesn't burn a core waiting on I/O. Push
+// and Pop touch only the atomics unless the other side is asleep.
+template<typename T, size_t N>
+class SpscQueue final
+{
+   static const int SPIN_COUNT = 100;
+
+   T slots_[N];
+   std::atomic<size_t> head_{0}; // Next slot to pop.
+   std::atomic<size_t> tail_{0}; // Next slot to push.
+   std::atomic<int> parked_{0}; // Sides sleeping on changed_.
+   std::mutex mutex_;
+   std::condition_variable changed_;
+
+   template<typename PredT>
+   void WaitFor(const PredT& fn_ready) {
+      for (int i = 0; i < SPIN_COUNT; ++i) {
+         if (fn_ready())
+            return;
+         std::this_thread::yield();
+      }
+      std::unique_lock<std::mutex> lock(mutex_);
+      parked_.fetch_add(1, std::memory_order_relaxed);
+      // Pairs with the fence in Notify: either we see the other side's
+      // update in fn_ready, or it sees us parked and wakes us.
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      changed_.wait(lock, fn_ready);
+      parked_.fetch_sub(1, std::memory_order_relaxed);
+   }
+
+   void Notify() {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (!parked_.load(std::memory_order_relaxed))
+         return;
+      // Taking the lock orders this against a waiter's check of fn_ready.
+      { std::lock_guard<std::mutex> lock(mutex_); }
+      changed_.notify_all();
+   }
+
+public:
+   void Push(T&& x) {
+      const auto tail = tail_.load(std::memory_order_relaxed);
+      WaitFor([&]() {
+         return tail - head_.load(std::memory_order_acquire) != N;
+      });
+      slots_[tail % N] = std::move(x);
+      tail_.store(tail + 1, std::memory_order_release);
+      Notify();
+   }
+
+   T Pop() {
+      const auto head = head_.load(std::memory_order_relaxed);
+      WaitFor([&]() {
+         return tail_.load(std::memory_order_acquire) != head;
+      });
+      auto ret = std::move(slots_[head % N]);
+      head_.store(head + 1, std::memory_order_release);
+      Notify();
+      return ret;
+   }
+};
+
+// Runs reading, reformatting and writing on three threads, passing chunks
+// between them through bounded queues, so the stages overlap. An empty chunk
+// marks the end of each queue.
+static bool
+ReformatPipelined(std::istream* const in, std::ostream* const out,
+                  const bool minify, std::string* const out_err)
+{
+   const size_t CHUNK_SIZE = 1 << 20;
+   SpscQueue<std::string, 16> in_chunks;
+   SpscQueue<std::string, 16> out_chunks;
+   std::atomic<bool> abort(false);
+
+   std::thread reader([&]() {
+      while (!abort) {
+         std::string chunk(CHUNK_SIZE, '\0');
+         in->read(&chunk[0], chunk.size());
+         chunk.resize(in->gcount());
+         if (chunk.empty())
+            break;
+         in_chunks.Push(std::move(chunk));
+      }
+      in_chunks.Push(std::string());
+   });
+
+   bool ok;
+   std::thread reformatter([&]() {
+      std::string chunk;
+      size_t chunk_pos = 0;
+      bool in_eof = false;
+      tjson::TokenStream tokens([&](char* const dest, const size_t size) {
+         if (chunk_pos == chunk.size() && !in_eof) {
+            chunk = in_chunks.Pop();
+            chunk_pos = 0;
+            in_eof = chunk.empty();
+         }
+         const auto n = std::min(size, chunk.size() - chunk_pos);
+         memcpy(dest, chunk.data() + chunk_pos, n);
+         chunk_pos += n;
+         return n;
+      });
+      ok = Reformat(&tokens, [&](std::string* const buf) {
+         if (buf->size()) {
+            out_chunks.Push(std::move(*buf));
+            buf->clear();
+         }
+      }, minify, out_err);
+      out_chunks.Push(std::string());
+
+      // Let the reader stop early, and unblock it if it's waiting on us.
+      abort = true;
+      while (!in_eof) {
+         in_eof = in_chunks.Pop().empty();
+      }
+   });
+
+   while (true) {
+      const auto chunk = out_chunks.Pop();
+      if (chunk.empty())
+         break;
+      out->write(chunk.data(), chunk.size());
+   }
+
+   reformatter.join();
+   reader.join();
+   return ok;
+}
+
+// -
+
+struct Options final
+{
+   bool stream = false;
+   bool minify = false;
+   bool pipeline = false;
+   bool tape = false; // Write the binary tape format instead of JSON.
+   std::string shm_name; // With `tape`, publish to shared memory instead.
+   bool select = false; // Stream out only the values at `path`.
+   tjson::Path path;
+   bool where = false; // Input is JSON Lines; pass those matching `filter`.
+   tjson::RecordFilter filter;
+   std::shared_ptr<const tjson::Schema> schema; // Validate while reading.
+   bool verbose = true; // Report each step on stderr.
+};
+
+// Rewrites one document from `in` to `out`.
+static bool
+Rewrite(std::istream* const in, std::ostream* const out, const Options& opts,
+        std::string* const out_err)
+{
+   if (opts.stream) {
+      if (opts.verbose) {
+         fprintf(stderr, "Rewriting tokens as they stream in:\n");
+      }
+      bool ok;
+      if (opts.select) {
+         tjson::TokenStream tokens([&](char* const dest, const size_t size) {
+            in->read(dest, size);
+            return size_t(in->gcount());
+         });
+         ReformatWriter writer([&](std::string* const buf) {
+            out->write(buf->data(), buf->size());
+            buf->clear();
+         }, opts.minify, true);
+         ok = tjson::select(&tokens, opts.path, &writer, out_err);
+         writer.Flush();
+         if (ok && in->bad()) {
+            *out_err = "rdstate: " + std::to_string(in->rdstate());
+            ok = false;
+         }
+         return ok;
+      } else if (opts.pipeline) {
+         ok = ReformatPipelined(in, out, opts.minify, out_err);
+      } else {
+         tjson::TokenStream tokens([&](char* const dest, const size_t size) {
+            in->read(dest, size);
+            return size_t(in->gcount());
+         });
+         ok = Reformat(&tokens, [&](std::string* const buf) {
+            out->write(buf->data(), buf->size());
+            buf->clear();
+         }, opts.minify, out_err);
+      }
+      if (!ok) {
+         out->flush();
+         return false;
+      }
+      if (in->bad()) {
+         *out_err = "rdstate: " + std::to_string(in->rdstate());
+         return false;
+      }
+      *out << "\n";
+      return true;
+   }
+
+   const auto bytes = ReadStream(in, out_err);
+
+   if (out_err->size())
+      return false;
+   if (opts.verbose) {
+      fprintf(stderr, "   Read %llu bytes.\n", uint64_t(bytes.size()));
+
+      fprintf(stderr, "Parsing...\n");
+   }
+
+   if (opts.where) {
+      size_t match_count = 0;
+      const auto ok = opts.filter.filter_lines(
+         (const char*)bytes.data(), (const char*)bytes.data() + bytes.size(),
+         [&](const char* const begin, const char* const end) {
+            out->write(begin, end - begin);
+            *out << "\n";
+            match_count += 1;
+         }, out_err);
+      if (ok && opts.verbose) {
+         fprintf(stderr, "   Matched %zu lines.\n", match_count);
+      }
+      return ok;
+   }
+
+   if (opts.tape) {
+      tjson::Tape tape;
+      if (!tape.parse((const char*)bytes.data(),
+                      (const char*)bytes.data() + bytes.size(), out_err))
+         return false;
+      if (opts.shm_name.size()) {
+         if (opts.verbose) {
+            fprintf(stderr, "Publishing to %s.\n", opts.shm_name.c_str());
+         }
+         return tjson::publish_shared(tape, opts.shm_name, out_err);
+      }
+      if (opts.verbose) {
+         fprintf(stderr, "Writing tape:\n");
+      }
+      tape.write_binary(out);
+      return true;
+   }
+
+   const auto begin = (const char*)bytes.data();
+   const auto end = begin + bytes.size();
+   const auto val = (opts.schema ? opts.schema->read(begin, end, out_err)
+                                 : tjson::read(begin, end, out_err));
+   if (!val)
+      return false;
+
+   if (opts.verbose) {
+      fprintf(stderr, "   Holding %zu bytes.\n", val->memory_usage().total());
+
+      fprintf(stderr, "Writing:\n");
+   }
+   val->write(out, "");
+   *out << "\n";
+   return true;
+}
+
+// -
+
+// Adds `path` to `out`: Directories are walked recursively for regular
+// files, skipping dotfiles, and "@list" adds each line of the file "list".
+static bool
+CollectInputs(const std::string& path, std::vector<std::string>* const out)
+{
+   if (path.size() && path[0] == '@') {
+      std::ifstream list(path.substr(1));
+      if (!list) {
+         fprintf(stderr, "Can't read list %s\n", path.c_str() + 1);
+         return false;
+      }
+      std::string line;
+      while (std::getline(list, line)) {
+         if (line.size() && !CollectInputs(line, out))
+            return false;
+      }
+      return true;
+   }
+
+   struct stat info;
+   if (stat(path.c_str(), &info) != 0) {
+      fprintf(stderr, "Can't stat %s\n", path.c_str());
+      return false;
+   }
+   if (!S_ISDIR(info.st_mode)) {
+      out->push_back(path);
+      return true;
+   }
+
+   const auto dir = opendir(path.c_str());
+   if (!dir) {
+      fprintf(stderr, "Can't open %s\n", path.c_str());
+      return false;
+   }
+   std::vector<std::string> names;
+   while (const auto entry = readdir(dir)) {
+      if (entry->d_name[0] != '.') {
+         names.push_back(entry->d_name);
+      }
+   }
+   closedir(dir);
+
+   std::sort(names.begin(), names.end());
+   for (const auto& name : names) {
+      if (!CollectInputs(path + "/" + name, out))
+         return false;
+   }
+   return true;
+}
+
+// `path` as a relative path to write under --out-dir: Without leading '/'s,
+// or "." or empty components. False if it has a ".." component.
+static bool
+RelativeOutputPath(const std::string& path, std::string* const out)
+{
+   out->clear();
+   size_t begin = 0;
+   while (begin <= path.size()) {
+      auto end = path.find('/', begin);
+      if (end == std::string::npos) {
+         end = path.size();
+      }
+      const auto part = path.substr(begin, end - begin);
+      if (part == "..")
+         return false;
+      if (part.size() && part != ".") {
+         if (out->size()) {
+            *out += '/';
+         }
+         *out += part;
+      }
+      begin = end + 1;
+   }
+   return !out->empty();
+}
+
+// Like `mkdir -p` for the directory containing `path`.
+static void
+MakeParentDirs(const std::string& path)
+{
+   auto pos = path.find('/', 1);
+   while (pos != std::string::npos) {
+      (void)mkdir(path.substr(0, pos).c_str(), 0777); // EEXIST is fine.
+      pos = path.find('/', pos + 1);
+   }
+}
+
+// Runs `fn(i)` for each i in [0, task_count) on `thread_count` threads.
+// Each thread takes tasks from the back of its own deque, and once that's
+// empty, steals from the front of the others'.
+static void
+RunWorkStealing(const size_t task_count, const size_t thread_count,
+                const std::function<void(size_t)>& fn)
+{
+   struct Queue final
+   {
+      std::mutex mutex;
+      std::deque<size_t> tasks;
+   };
+   std::vector<Queue> queues(thread_count);
+   for (size_t i = 0; i < task_count; ++i) {
+      queues[i % thread_count].tasks.push_back(i);
+   }
+
+   const auto fn_take = [&](const size_t queue_id, const bool own, size_t* out) {
+      auto& queue = queues[queue_id];
+      const std::lock_guard<std::mutex> lock(queue.mutex);
+      if (queue.tasks.empty())
+         return false;
+      if (own) {
+         *out = queue.tasks.back();
+         queue.tasks.pop_back();
+      } else {
+         *out = queue.tasks.front();
+         queue.tasks.pop_front();
+      }
+      return true;
+   };
+
+   // No tasks are added once started, so a thread is done once it finds
+   // every queue empty.
+   const auto fn_worker = [&](const size_t id) {
+      size_t task;
+      while (true) {
+         bool found = fn_take(id, true, &task);
+         for (size_t i = 1; !found && i < thread_count; ++i) {
+            found = fn_take((id + i) % thread_count, false, &task);
+         }
+         if (!found)
+            return;
+         fn(task);
+      }
+   };
+
+   std::vector<std::thread> threads;
+   for (size_t i = 1; i < thread_count; ++i) {
+      threads.push_back(std::thread(fn_worker, i));
+   }
+   fn_worker(0);
+   for (auto& t : threads) {
+      t.join();
+   }
+}
+
+// Rewrites each of `inputs` into the same relative path under `out_dir`,
+// then reports aggregate throughput.
+static bool
+RewriteFiles(const std::vector<std::string>& inputs, const std::string& out_dir,
+             const Options& opts, const size_t thread_count)
+{
+   fprintf(stderr, "Rewriting %zu files into %s on %zu threads...\n",
+           inputs.size(), out_dir.c_str(), thread_count);
+   const auto start = std::chrono::steady_clock::now();
+
+   std::atomic<uint64_t> bytes_read(0);
+   std::atomic<size_t> fail_count(0);
+   RunWorkStealing(inputs.size(), thread_count, [&](const size_t i) {
+      const auto& in_path = inputs[i];
+      const auto fn_fail = [&](const std::string& err) {
+         fail_count += 1;
+         fprintf(stderr, "%s: %s\n", in_path.c_str(), err.c_str());
+      };
+
+      std::string rel_path;
+      if (!RelativeOutputPath(in_path, &rel_path))
+         return fn_fail("Has a \"..\", so would be written outside " +
+                        out_dir + ".");
+      const auto out_path = out_dir + "/" + rel_path;
+      struct stat in_info;
+      struct stat out_info;
+      if (stat(in_path.c_str(), &in_info) != 0)
+         return fn_fail("Can't stat.");
+      if (stat(out_path.c_str(), &out_info) == 0 &&
+          out_info.st_dev == in_info.st_dev &&
+          out_info.st_ino == in_info.st_ino)
+      {
+         return fn_fail("Would be overwritten by its own output.");
+      }
+      MakeParentDirs(out_path);
+
+      // Written beside the output and renamed over it once complete, so a
+      // failure never leaves a truncated file behind.
+      const auto tmp_path = out_path + ".tmp";
+      std::string err;
+      std::ifstream in(in_path, std::ios_base::in | std::ios_base::binary);
+      if (!in)
+         return fn_fail("Can't read.");
+      std::ofstream out(tmp_path, std::ios_base::out | std::ios_base::binary);
+      if (!out)
+         return fn_fail("Can't write " + tmp_path + ".");
+      auto ok = Rewrite(&in, &out, opts, &err);
+      out.close();
+      if (ok && !out) {
+         err = "Can't write " + tmp_path + ".";
+         ok = false;
+      }
+      if (ok && rename(tmp_path.c_str(), out_path.c_str()) != 0) {
+         err = "Can't rename to " + out_path + ": " + strerror(errno);
+         ok = false;
+      }
+      if (!ok) {
+         (void)unlink(tmp_path.c_str());
+         return fn_fail(err);
+      }
+      bytes_read += uint64_t(in_info.st_size);
+   });
+
+   const auto secs = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+   const auto mb = double(bytes_read) / (1000*1000);
+   fprintf(stderr, "Rewrote %zu of %zu files, %.1f MB in %.2fs: %.1f MB/s,"
+           " %.0f files/s.\n", inputs.size() - fail_count, inputs.size(), mb,
+           secs, mb / secs, inputs.size() / secs);
+   return !fail_count;
+}
+
+// -
+
 int
 main(int argc, const char* const argv[])
 {
-   std::string err;
-   const auto bytes = [&]() {
-      std::istream* in;
-      std::ifstream file_in;
-      if (argc < 2) {
-         fprintf(stderr, "Reading STDIN...\n");
-         in = &std::cin;
+   Options opts;
+   std::vector<std::string> inputs;
+   std::string out_dir;
+   size_t thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+   const auto fn_usage = [&]() {
+      fprintf(stderr, "Usage: %s [--stream] [--minify] [--pipeline]"
+              " [--tape [--shm NAME]] [--path EXPR] [--where KEY=VALUE]"
+              " [--schema FILE]"
+              " [--out-dir DIR [--jobs N]] [PATH | DIR | @LIST]...\n", argv[0]);
+      return 1;
+   };
+   for (int i = 1; i < argc; ++i) {
+      const std::string arg = argv[i];
+      if (arg == "--stream") {
+         opts.stream = true;
+      } else if (arg == "--minify") {
+         opts.stream = true;
+         opts.minify = true;
+      } else if (arg == "--pipeline") {
+         opts.stream = true;
+         opts.pipeline = true;
+      } else if (arg == "--path" && i + 1 < argc) {
+         std::string err;
+         if (!tjson::Path::parse(argv[++i], &opts.path, &err)) {
+            fprintf(stderr, "%s\n", err.c_str());
+            return 1;
+         }
+         opts.stream = true;
+         opts.select = true;
+      } else if (arg == "--where" && i + 1 < argc) {
+         std::string err;
+         if (!tjson::RecordFilter::parse(argv[++i], &opts.filter, &err)) {
+            fprintf(stderr, "%s\n", err.c_str());
+            return 1;
+         }
+         opts.where = true;
+      } else if (arg == "--schema" && i + 1 < argc) {
+         const auto path = argv[++i];
+         std::ifstream in(path, std::ios_base::in | std::ios_base::binary);
+         std::string err = (in ? "" : "Can't read.");
+         const auto bytes = (in ? ReadStream(&in, &err) : std::vector<uint8_t>());
+         std::unique_ptr<tjson::Val> doc;
+         if (err.empty()) {
+            doc = tjson::read((const char*)bytes.data(),
+                              (const char*)bytes.data() + bytes.size(), &err);
+         }
+         if (doc) {
+            opts.schema = tjson::Schema::compile(*doc, &err);
+         }
+         if (!opts.schema) {
+            fprintf(stderr, "%s: %s\n", path, err.c_str());
+            return 1;
+         }
+      } else if (arg == "--tape") {
+         opts.tape = true;
+      } else if (arg == "--shm" && i + 1 < argc) {
+         opts.tape = true;
+         opts.shm_name = argv[++i];
+      } else if (arg == "--out-dir" && i + 1 < argc) {
+         out_dir = argv[++i];
+      } else if (arg == "--jobs" && i + 1 < argc) {
+         const auto str = argv[++i];
+         char* end;
+         errno = 0;
+         const auto jobs = strtoul(str, &end, 10);
+         if (end == str || *end || errno || !jobs) {
+            fprintf(stderr, "--jobs needs a positive count, got: %s\n", str);
+            return fn_usage();
+         }
+         thread_count = jobs;
+      } else if (arg.compare(0, 2, "--")) {
+         if (!CollectInputs(arg, &inputs))
+            return 1;
       } else {
-         const auto path = argv[1];
-         fprintf(stderr, "Reading %s...\n", path);
-         file_in.open(path, std::ios_base::in | std::ios_base::binary);
-         in = &file_in;
+         return fn_usage();
       }
+   }
 
-      return ReadStream(in, &err);
-   }();
+   if (opts.select && opts.pipeline) {
+      fprintf(stderr, "--path selects as it tokenizes, so can't pipeline.\n");
+      return fn_usage();
+   }
 
-   if (err.size()) {
-      fprintf(stderr, "%s\n", err.c_str());
-      return 1;
+   if (opts.tape && opts.stream) {
+      fprintf(stderr, "--tape needs the whole document, so can't stream.\n");
+      return fn_usage();
    }
-   fprintf(stderr, "   Read %llu bytes.\n", uint64_t(bytes.size()));
 
-   fprintf(stderr, "Parsing...\n");
+   // --minify, --pipeline and --path all imply --stream, so name the one given.
+   if (opts.where && (opts.tape || opts.stream)) {
+      fprintf(stderr, "--where passes matching JSON Lines through as they are,"
+              " so can't be combined with %s.\n",
+              opts.tape ? "--tape" : opts.minify ? "--minify"
+              : opts.pipeline ? "--pipeline" : opts.select ? "--path"
+              : "--stream");
+      return fn_usage();
+   }
 
-   const auto val = tjson::read((const char*)bytes.data(),
-                                (const char*)bytes.data()+bytes.size(), &err);
-   if (!val) {
-      fprintf(stderr, "%s\n", err.c_str());
-      return 1;
+   if (opts.schema && (opts.stream || opts.tape || opts.where)) {
+      fprintf(stderr, "--schema validates as it reads the tree, so can't"
+              " stream, --tape or --where.\n");
+      return fn_usage();
    }
 
-   fprintf(stderr, "Writing:\n");
-   val->write(&std::cout, "");
-   std::cout << "\n";
+   if (opts.shm_name.size() && (out_dir.size() || inputs.size() > 1)) {
+      fprintf(stderr, "--shm publishes a single document.\n");
+      return fn_usage();
+   }
+
+   if (out_dir.size()) {
+      if (inputs.empty())
+         return fn_usage();
+      opts.verbose = false;
+      return RewriteFiles(inputs, out_dir, opts, thread_count) ? 0 : 1;
+   }
+   if (inputs.size() > 1) {
+      fprintf(stderr, "Multiple inputs need --out-dir.\n");
+      return fn_usage();
+   }
+
+   std::string err;
+   std::istream* in;
+   std::ifstream file_in;
+   if (inputs.empty()) {
+      fprintf(stderr, "Reading STDIN...\n");
+      in = &std::cin;
+   } else {
+      const auto& path = inputs[0];
+      fprintf(stderr, "Reading %s...\n", path.c_str());
+      file_in.open(path, std::ios_base::in | std::ios_base::binary);
+      in = &file_in;
+   }
+
+   if (!Rewrite(in, &std::cout, opts, &err)) {
+      // Streamed output may have stopped mid-line.
+      fprintf(stderr, opts.stream ? "\n%s\n" : "%s\n", err.c_str());
+      return 1;
+   }
    return 0;
 }
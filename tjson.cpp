@@ -1,11 +1,25 @@
 #include "tjson.h"
 
+#include "tjson_kernels.h"
+#include "tjson_walk.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <condition_variable>
 #include <cstdio>
+#include <cstring>
+#include <deque>
 #include <locale>
+#include <mutex>
 #include <ostream>
-#include <regex>
 #include <sstream>
+#include <thread>
 
 namespace tjson {
 
@@ -20,40 +34,71 @@ escape(const std::string& in)
    out.reserve(in.size() + 2); // Only reserve the required quotes.
 
    out += '"';
-   for (const auto c : in) {
-      if (c == '"' || c == '\\') {
-         out += '\\';
-      }
-      out += c;
+   const auto& k = kernels();
+   auto itr = in.data();
+   const auto end = in.data() + in.size();
+   while (true) {
+      const auto special = k.find_quote_or_backslash(itr, end);
+      out.append(itr, special);
+      if (special == end)
+         break;
+      out += '\\';
+      out += *special;
+      itr = special + 1;
    }
    out += '"';
    return out;
 }
 
-bool
-unescape(const std::string& in, std::string* const out)
+// Like unescape(), but reuses `out`'s capacity, and leaves it unspecified on
+// failure.
+static bool
+unescape_into(const char* const begin, const char* const end,
+              std::string* const out)
 {
-   if (in.size() < 2)
+   const auto size = size_t(end - begin);
+   if (size < 2)
       return false;
-   if (in[0] != '"' || in[in.size()-1] != '"')
+   if (begin[0] != '"' || end[-1] != '"')
       return false;
 
-   std::string wip;
-   wip.reserve(in.size() - 2);
-
-   bool in_escape = false;
-   auto itr = in.c_str() + 1;
-   const auto end = in.c_str() + in.size() - 1;
-   for (; itr != end; ++itr) {
-      const auto& c = *itr;
-      if (!in_escape && c == '\\') {
-         in_escape = true;
-      } else {
-         in_escape = false;
-         wip += c;
+   auto& wip = *out;
+   wip.clear();
+   wip.reserve(size - 2);
+
+   // Copy runs between escapes whole. A stray '"' inside is just copied.
+   const auto& k = kernels();
+   auto itr = begin + 1;
+   const auto inner_end = end - 1;
+   while (true) {
+      const auto special = k.find_quote_or_backslash(itr, inner_end);
+      wip.append(itr, special);
+      if (special == inner_end)
+         return true;
+      if (*special == '"') {
+         wip += '"';
+         itr = special + 1;
+         continue;
       }
+      if (special + 1 == inner_end)
+         return false; // Dangling escape.
+      wip += special[1];
+      itr = special + 2;
    }
-   if (in_escape)
+}
+
+bool
+unescape(const std::string& in, std::string* const out)
+{
+   return unescape(in.data(), in.data() + in.size(), out);
+}
+
+bool
+unescape(const char* const begin, const char* const end,
+         std::string* const out)
+{
+   std::string wip;
+   if (!unescape_into(begin, end, &wip))
       return false;
 
    *out = std::move(wip);
@@ -62,94 +107,432 @@ unescape(const std::string& in, std::string* const out)
 
 // -
 
-struct Token final
+bool
+Token::operator==(const char* const r) const
 {
-   enum class Type : uint8_t {
-      MALFORMED = '?',
-      WHITESPACE = '_',
-      STRING = '"',
-      WORD = 'a',
-      SYMBOL = '$',
-   };
+   const auto len = strlen(r);
+   if (len != end - begin)
+      return false;
+   return std::equal(begin, end, r);
+}
 
-   const char* begin;
-   const char* end;
-   uint64_t line_num;
-   uint64_t line_pos;
-   Type type;
+std::string
+Token::expected_err(const char* const expected) const
+{
+   auto got = str();
+   if (got.length() > 20) {
+      got.resize(20);
+   }
 
-   bool operator==(const char* const r) const {
-      const auto len = strlen(r);
-      if (len != end - begin)
-         return false;
-      return std::equal(begin, end, r);
+   std::ostringstream err;
+   err << "Error: L" << line_num << ":" << line_pos << ": Expected "
+       << expected << ", got: \"" << got << "\".";
+   return err.str();
+}
+
+static bool
+is_whitespace(const char c)
+{
+   return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static bool
+is_word_char(const char c)
+{
+   return ('A' <= c && c <= 'Z') || ('a' <= c && c <= 'z') ||
+          ('0' <= c && c <= '9') || c == '_' || c == '+' || c == '-' ||
+          c == '.';
+}
+
+static bool
+is_symbol(const char c)
+{
+   return c == '{' || c == ':' || c == ',' || c == '}' || c == '[' || c == ']';
+}
+
+// Returns the end of the string token starting at `begin`, or nullptr if it's
+// unterminated. A backslash escapes any next char except a line break.
+static const char*
+scan_string(const char* const begin, const char* const end)
+{
+   const auto& k = kernels();
+   auto itr = begin + 1;
+   while (true) {
+      itr = k.find_quote_or_backslash(itr, end);
+      if (itr == end)
+         return nullptr;
+      if (*itr == '"')
+         return itr + 1;
+      if (itr + 1 == end || itr[1] == '\n' || itr[1] == '\r')
+         return nullptr;
+      itr += 2;
    }
+}
 
-   std::string str() const { return std::string(begin, end); }
-};
+// -
+// Numbers follow JSON's grammar, except that a leading '+' is allowed too.
+// Digits are consumed eight at a time where possible, as SWAR on a uint64_t.
 
-const std::regex RE_WHITESPACE(R"([ \t\n\r]+)");
-const std::regex RE_STRING(R"_("(:?[^"\\]*(:?\\.)*)*")_");
-const std::regex RE_WORD(R"([A-Za-z0-9_+\-.]+)");
-const std::regex RE_SYMBOL(R"([{:,}\[\]])");
+struct NumberParts final
+{
+   uint64_t mantissa = 0; // All digits, ignoring the decimal point.
+   int digit_count = 0;   // How many digits went into `mantissa`.
+   bool overflowed = false; // More than 19 digits; `mantissa` is partial.
+   int64_t exp10 = 0;
+   bool negative = false;
+};
 
 static bool
-next_token_from_regex(const std::regex& regex, Token* const out)
+is_eight_digits(const uint64_t chunk)
 {
-   std::cmatch res;
-   if (!std::regex_search(out->begin, out->end, res, regex,
-                          std::regex_constants::match_continuous))
-   {
-      return false;
+   return !(((chunk + 0x4646464646464646) | (chunk - 0x3030303030303030)) &
+            0x8080808080808080);
+}
+
+// Converts eight ASCII digits, the first in the lowest byte.
+static uint32_t
+parse_eight_digits(uint64_t chunk)
+{
+   chunk -= 0x3030303030303030;
+   chunk = (chunk * 10) + (chunk >> 8);
+   chunk = (((chunk & 0x000000ff000000ff) * 0x000f424000000064) +
+            (((chunk >> 16) & 0x000000ff000000ff) * 0x0000271000000001)) >> 32;
+   return uint32_t(chunk);
+}
+
+static const char*
+scan_digits(const char* itr, const char* const end, NumberParts* const parts)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+   while (end - itr >= 8) {
+      uint64_t chunk;
+      memcpy(&chunk, itr, 8);
+      if (!is_eight_digits(chunk))
+         break;
+      if (parts->digit_count + 8 <= 19) {
+         parts->mantissa = parts->mantissa * 100000000 + parse_eight_digits(chunk);
+         parts->digit_count += 8;
+      } else {
+         parts->overflowed = true;
+      }
+      itr += 8;
    }
-   out->end = out->begin + res.length();
-   return true;
+#endif
+   for (; itr != end && '0' <= *itr && *itr <= '9'; ++itr) {
+      if (parts->digit_count < 19) {
+         parts->mantissa = parts->mantissa * 10 + uint64_t(*itr - '0');
+         parts->digit_count += 1;
+      } else {
+         parts->overflowed = true;
+      }
+   }
+   return itr;
 }
 
-class TokenGen final
+// Returns the end of the number at `begin`, or nullptr if there isn't a
+// well-formed one.
+static const char*
+scan_number(const char* itr, const char* const end, NumberParts* const parts)
 {
-   Token meta_token_;
+   if (itr != end && (*itr == '-' || *itr == '+')) {
+      parts->negative = (*itr == '-');
+      ++itr;
+   }
+   if (itr == end || *itr < '0' || '9' < *itr)
+      return nullptr;
 
-public:
-   TokenGen(const char* const begin, const char* const end)
-      : meta_token_{begin, end, 1, 1, Token::Type::MALFORMED}
-   { }
+   // No leading zeros.
+   if (*itr == '0') {
+      ++itr;
+   } else {
+      itr = scan_digits(itr, end, parts);
+   }
+   const auto int_digit_count = parts->digit_count;
+
+   if (itr != end && *itr == '.') {
+      const auto frac_begin = ++itr;
+      itr = scan_digits(itr, end, parts);
+      if (itr == frac_begin)
+         return nullptr;
+      parts->exp10 -= (parts->digit_count - int_digit_count);
+   }
+
+   if (itr != end && (*itr == 'e' || *itr == 'E')) {
+      ++itr;
+      bool exp_negative = false;
+      if (itr != end && (*itr == '-' || *itr == '+')) {
+         exp_negative = (*itr == '-');
+         ++itr;
+      }
+      const auto exp_begin = itr;
+      int64_t exp = 0;
+      for (; itr != end && '0' <= *itr && *itr <= '9'; ++itr) {
+         if (exp < 100000) { // Way past double's range already.
+            exp = exp * 10 + (*itr - '0');
+         }
+      }
+      if (itr == exp_begin)
+         return nullptr;
+      parts->exp10 += (exp_negative ? -exp : exp);
+   }
+   return itr;
+}
 
-   Token Next() {
-      auto ret = meta_token_;
-      if (next_token_from_regex(RE_WHITESPACE, &ret)) {
+Token
+TokenGen::Next()
+{
+   // Anything unrecognized is MALFORMED through to the end.
+   auto ret = meta_token_;
+   if (ret.begin != ret.end) {
+      const auto c = *ret.begin;
+      if (is_whitespace(c)) {
          ret.type = Token::Type::WHITESPACE;
-      } else if (next_token_from_regex(RE_STRING, &ret)) {
-         ret.type = Token::Type::STRING;
-      } else if (next_token_from_regex(RE_WORD, &ret)) {
+         ret.end = ret.begin + 1;
+         // Most whitespace is a single space, so only dispatch for more.
+         if (ret.end != meta_token_.end && is_whitespace(*ret.end)) {
+            ret.end = kernels().skip_whitespace(ret.end, meta_token_.end);
+         }
+      } else if (c == '"') {
+         if (const auto str_end = scan_string(ret.begin, ret.end)) {
+            ret.type = Token::Type::STRING;
+            ret.end = str_end;
+         }
+      } else if (c == '-' || c == '+' || ('0' <= c && c <= '9')) {
+         // A number, which must be well-formed and not run into other word
+         // chars.
+         NumberParts parts;
+         const auto num_end = scan_number(ret.begin, ret.end, &parts);
+         if (num_end && (num_end == ret.end || !is_word_char(*num_end))) {
+            ret.type = Token::Type::WORD;
+            ret.end = num_end;
+         }
+      } else if (is_word_char(c)) {
          ret.type = Token::Type::WORD;
-      } else if (next_token_from_regex(RE_SYMBOL, &ret)) {
+         ret.end = ret.begin + 1;
+         while (ret.end != meta_token_.end && is_word_char(*ret.end)) {
+            ++ret.end;
+         }
+      } else if (is_symbol(c)) {
          ret.type = Token::Type::SYMBOL;
+         ret.end = ret.begin + 1;
       }
+   }
 
-      meta_token_.begin = ret.end;
-      for (auto itr = ret.begin; itr != ret.end; ++itr) {
-         if (*itr == '\n') {
-            meta_token_.line_num += 1;
-            meta_token_.line_pos = 0;
-         }
-         meta_token_.line_pos += 1;
+   meta_token_.begin = ret.end;
+   for (auto itr = ret.begin; itr != ret.end; ++itr) {
+      if (*itr == '\n') {
+         meta_token_.line_num += 1;
+         meta_token_.line_pos = 0;
       }
-      return ret;
+      meta_token_.line_pos += 1;
    }
+   return ret;
+}
 
-   Token NextNonWS() {
-      while (true) {
-         const auto ret = Next();
-         if (ret.type != Token::Type::WHITESPACE) {
+Token
+TokenGen::NextNonWS()
+{
+   while (true) {
+      const auto ret = Next();
+      if (ret.type != Token::Type::WHITESPACE) {
 
 //#define SPEW_TOKENS
 #ifdef SPEW_TOKENS
-            fprintf(stderr, "%c @ L%llu:%llu: %s\n\n", int(ret.type), ret.line_num,
-                    ret.line_pos, ret.str().c_str());
+         fprintf(stderr, "%c @ L%llu:%llu: %s\n\n", int(ret.type), ret.line_num,
+                 ret.line_pos, ret.str().c_str());
 #endif
-            return ret;
+         return ret;
+      }
+   }
+}
+
+// -
+
+TokenStream::TokenStream(const ReadFn& fn_read, const size_t chunk_size)
+   : fn_read_(fn_read)
+   , buf_(std::max(chunk_size, size_t(1)))
+   , tok_gen_(buf_.data(), buf_.data())
+{ }
+
+Token
+TokenStream::Next()
+{
+   while (true) {
+      auto peek_gen = tok_gen_;
+      const auto ret = peek_gen.Next();
+      // A token that runs into the end of the buffer may continue in the
+      // next chunk. A MALFORMED one only might if it's an unterminated
+      // string, or a word that more chars could make a number.
+      auto is_final = (ret.end != buf_.data() + buf_size_ || eof_);
+      if (!is_final && ret.type == Token::Type::MALFORMED &&
+          ret.begin != ret.end)
+      {
+         is_final = !(*ret.begin == '"' ||
+                      std::all_of(ret.begin, ret.end, is_word_char));
+      }
+      if (!is_final && size_t(ret.end - ret.begin) >= MAX_TOKEN_SIZE) {
+         tok_gen_ = peek_gen;
+         auto too_long = ret;
+         too_long.type = Token::Type::MALFORMED;
+         return too_long;
+      }
+      if (is_final) {
+         tok_gen_ = peek_gen;
+         return ret;
+      }
+      Refill(ret);
+   }
+}
+
+Token
+TokenStream::NextNonWS()
+{
+   while (true) {
+      const auto ret = Next();
+      if (ret.type != Token::Type::WHITESPACE)
+         return ret;
+   }
+}
+
+void
+TokenStream::Refill(const Token& from)
+{
+   // Keep the partial token, and make room for at least a chunk after it.
+   const auto keep_size = size_t(buf_.data() + buf_size_ - from.begin);
+   std::copy(from.begin, from.begin + keep_size, buf_.data());
+   buf_size_ = keep_size;
+   if (buf_.size() - buf_size_ < buf_size_) {
+      buf_.resize(buf_.size() * 2);
+   }
+
+   while (buf_size_ < buf_.size()) {
+      const auto read = fn_read_(buf_.data() + buf_size_,
+                                 buf_.size() - buf_size_);
+      if (!read) {
+         eof_ = true;
+         break;
+      }
+      buf_size_ += read;
+   }
+
+   auto pos = from;
+   pos.begin = buf_.data();
+   pos.end = buf_.data() + buf_size_;
+   tok_gen_ = TokenGen(pos);
+}
+
+// -
+
+// A container's last serialization. Children link to their parent's cache
+// weakly, so a change can discard the caches above it, even if the child has
+// since been moved elsewhere or the parent freed.
+struct WriteCache final
+{
+   std::string bytes;
+   std::string indent;
+   size_t depth = 0;
+   bool valid = false;
+   bool too_big = false; // Last write, more than max_fragment, if unchanged.
+   size_t max_fragment = 0;
+
+   const Val* owner;
+   WriteCache* parent = nullptr; // Counted, so it outlives its children.
+   // From `owner`, the scalars under it, and child containers' caches. Atomic
+   // because destroy_parallel() frees subtrees on several threads.
+   std::atomic<size_t> refs{0};
+
+   // From read_retaining(), until the first change: the container's text in
+   // `source`, written as is in place of `bytes`.
+   std::shared_ptr<const std::string> source;
+   const char* source_begin = nullptr;
+   size_t source_size = 0;
+
+   WriteCache(const Val* const owner, const size_t max_fragment)
+      : max_fragment(max_fragment)
+      , owner(owner)
+   { }
+
+   static void hold(WriteCache* const cache) {
+      if (cache) {
+         cache->refs.fetch_add(1, std::memory_order_relaxed);
+      }
+   }
+   static void release(WriteCache* cache) {
+      while (cache && cache->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+         const auto parent = cache->parent;
+         delete cache;
+         cache = parent;
+      }
+   }
+   static void set(Val* const val, WriteCache* const cache) {
+      hold(cache);
+      release(val->write_cache_);
+      val->write_cache_ = cache;
+   }
+   static void set_parent(WriteCache* const cache, WriteCache* const parent) {
+      hold(parent);
+      release(cache->parent);
+      cache->parent = parent;
+   }
+
+   // The cache `val` owns, if any, rather than shares as a scalar.
+   static WriteCache* of(const Val& val) {
+      const auto cache = val.write_cache_;
+      return (cache && cache->owner == &val ? cache : nullptr);
+   }
+
+   // Gives `val` its own cache, linked to whatever it had before.
+   static WriteCache* create(Val* const val, const size_t max_fragment) {
+      if (const auto cache = of(*val))
+         return cache;
+      const auto cache = new WriteCache(val, max_fragment);
+      set_parent(cache, val->write_cache_);
+      set(val, cache);
+      return cache;
+   }
+
+   // For read_retaining(), which calls these as it builds each node.
+   static void link(Val* const child, const Val& parent) {
+      if (const auto cache = of(*child)) {
+         set_parent(cache, parent.write_cache_);
+      } else {
+         set(child, parent.write_cache_);
+      }
+   }
+   static void retain(const Val& val,
+                      const std::shared_ptr<const std::string>& source,
+                      const char* const begin, const char* const end) {
+      const auto cache = val.write_cache_;
+      cache->source = source;
+      cache->source_begin = begin;
+      cache->source_size = size_t(end - begin);
+      cache->valid = true;
+   }
+
+   // Links each child to `parent`'s cache: Containers get their own, created
+   // as needed, and scalars share the parent's.
+   static void attach_children(const Val& parent) {
+      const auto cache = parent.write_cache_;
+      const auto fn_attach = [&](Val* const child) {
+         if (!(child->is_dict() || child->is_list())) {
+            if (child->write_cache_ != cache) {
+               set(child, cache);
+            }
+            return;
          }
+         if (const auto own = of(*child)) {
+            if (own->parent != cache) {
+               set_parent(own, cache);
+            }
+            return;
+         }
+         set_parent(create(child, cache->max_fragment), cache);
+      };
+      for (const auto& kv : parent.dict_) {
+         fn_attach(kv.second.get());
+      }
+      for (const auto& child : parent.list_) {
+         fn_attach(child.get());
       }
    }
 };
@@ -160,25 +543,54 @@ std::unique_ptr<Val>
 read(const char* const begin, const char* const end,
      std::string* const out_err)
 {
-   TokenGen tok_gen(begin, end);
-   auto ret = read(&tok_gen, out_err);
-   return std::move(ret);
+   Reader reader;
+   return reader.read(begin, end, out_err);
 }
 
 std::unique_ptr<Val>
 read(TokenGen* const tok_gen,
      std::string* const out_err)
 {
-   const auto fn_err = [&](const Token& tok, const char* const expected) {
-      auto str = tok.str();
-      if (str.length() > 20) {
-         str.resize(20);
-      }
+   Reader reader;
+   return reader.read(tok_gen, out_err);
+}
 
-      std::ostringstream err;
-      err << "Error: L" << tok.line_num << ":" << tok.line_pos << ": Expected "
-          << expected << ", got: \"" << str << "\".";
-      *out_err = err.str();
+std::unique_ptr<Val>
+read_retaining(std::shared_ptr<const std::string> text,
+               std::string* const out_err, const size_t max_fragment)
+{
+   Reader reader;
+   return reader.read_retaining(std::move(text), out_err, max_fragment);
+}
+
+// -
+
+std::unique_ptr<Val>
+Reader::read(const char* const begin, const char* const end,
+             std::string* const out_err)
+{
+   TokenGen tok_gen(begin, end);
+   return read(&tok_gen, out_err);
+}
+
+std::unique_ptr<Val>
+Reader::read_retaining(std::shared_ptr<const std::string> text,
+                       std::string* const out_err, const size_t max_fragment)
+{
+   source_ = std::move(text);
+   max_fragment_ = max_fragment;
+   TokenGen tok_gen(source_->data(), source_->data() + source_->size());
+   auto ret = read(&tok_gen, out_err);
+   source_ = nullptr;
+   return ret;
+}
+
+std::unique_ptr<Val>
+Reader::read(TokenGen* const tok_gen,
+             std::string* const out_err)
+{
+   const auto fn_err = [&](const Token& tok, const char* const expected) {
+      *out_err = tok.expected_err(expected);
    };
 
    const auto fn_is_expected = [&](const Token& tok,
@@ -207,9 +619,13 @@ read(TokenGen* const tok_gen,
    const auto tok = tok_gen->NextNonWS();
    if (tok == "{") {
       cur.set_dict();
+      if (source_) {
+         WriteCache::create(&cur, max_fragment_);
+      }
 
       auto peek_gen = *tok_gen;
       const auto peek = peek_gen.NextNonWS();
+      auto close = peek;
       if (peek == "}") {
          *tok_gen = peek_gen;
       } else {
@@ -227,115 +643,464 @@ read(TokenGen* const tok_gen,
             auto v = read(tok_gen, out_err);
             if (!v)
                return nullptr;
+            if (source_) {
+               WriteCache::link(v.get(), cur);
+            }
 
-            std::string key_name;
-            (void)unescape(k.str(), &key_name);
-            cur[key_name] = std::move(v); // Overwrite.
+            // `v` is read first, so key_scratch_ is free to reuse here.
+            if (!unescape_into(k.begin, k.end, &key_scratch_)) {
+               key_scratch_.clear();
+            }
+            cur.dict_[key_scratch_] = std::move(v); // Overwrite.
 
             const auto comma = tok_gen->NextNonWS();
-            if (comma == "}")
+            if (comma == "}") {
+               close = comma;
                break;
+            }
             if (!fn_is_expected(comma, ","))
                return nullptr;
             continue;
          }
       }
+      if (source_) {
+         WriteCache::retain(cur, source_, tok.begin, close.end);
+      }
       return ret;
    }
 
    if (tok == "[") {
       cur.set_list();
+      if (source_) {
+         WriteCache::create(&cur, max_fragment_);
+      }
 
       auto peek_gen = *tok_gen;
       const auto peek = peek_gen.NextNonWS();
+      auto close = peek;
       if (peek == "]") {
          *tok_gen = peek_gen;
       } else {
-         size_t i = 0;
          while (true) {
             auto v = read(tok_gen, out_err);
             if (!v)
                return nullptr;
+            if (source_) {
+               WriteCache::link(v.get(), cur);
+            }
 
-            cur[i] = std::move(v);
-            i += 1;
+            cur.list_.push_back(std::move(v));
 
             const auto comma = tok_gen->NextNonWS();
-            if (comma == "]")
+            if (comma == "]") {
+               close = comma;
                break;
+            }
             if (!fn_is_expected(comma, ","))
                return nullptr;
             continue;
          }
       }
+      if (source_) {
+         WriteCache::retain(cur, source_, tok.begin, close.end);
+      }
       return ret;
    }
 
    if (!fn_is_expected(tok))
       return nullptr;
 
-   cur.val() = tok.str();
+   cur.set_val(tok.str());
    return ret;
 }
 
 void
-write(const Val& root, std::ostream* const out, const std::string& indent)
+read_batch(const std::vector<Span>& docs, std::vector<ReadResult>* const out,
+           const size_t thread_count)
+{
+   out->resize(docs.size());
+
+   const auto fn_read_one = [&](Reader* const reader, const size_t i) {
+      auto& res = (*out)[i];
+      res.err.clear();
+      res.val = reader->read(docs[i].begin, docs[i].end, &res.err);
+   };
+
+   if (thread_count <= 1 || docs.size() <= 1) {
+      Reader reader;
+      for (size_t i = 0; i < docs.size(); ++i) {
+         fn_read_one(&reader, i);
+      }
+      return;
+   }
+
+   // Docs are small, so hand them out in blocks to keep the shared counter
+   // out of the per-doc cost.
+   const size_t BLOCK_SIZE = 64;
+   std::atomic<size_t> next_block(0);
+   const auto fn_worker = [&]() {
+      Reader reader;
+      while (true) {
+         const auto begin = next_block.fetch_add(BLOCK_SIZE);
+         if (begin >= docs.size())
+            return;
+         const auto end = std::min(begin + BLOCK_SIZE, docs.size());
+         for (auto i = begin; i < end; ++i) {
+            fn_read_one(&reader, i);
+         }
+      }
+   };
+
+   std::vector<std::thread> threads;
+   for (size_t i = 1; i < thread_count; ++i) {
+      threads.push_back(std::thread(fn_worker));
+   }
+   fn_worker();
+   for (auto& t : threads) {
+      t.join();
+   }
+}
+
+// -
+
+namespace {
+
+struct NullHandler final
+{
+   bool OnOpen(const Token&) { return true; }
+   bool OnKey(const Token&) { return true; }
+   bool OnScalar(const Token&) { return true; }
+   bool OnClose(const Token&) { return true; }
+};
+
+} // namespace
+
+bool
+validate_utf8(const char* const begin, const char* const end)
+{
+   return kernels().validate_utf8(begin, end);
+}
+
+bool
+validate(const char* const begin, const char* const end,
+         std::string* const out_err)
+{
+   TokenGen tok_gen(begin, end);
+   NullHandler handler;
+   return walk(&tok_gen, &handler, out_err);
+}
+
+// -
+
+struct AppendTo final
+{
+   std::string* out;
+
+   void operator()(const char* const data, const size_t size) const {
+      out->append(data, size);
+   }
+};
+
+struct CountTo final
+{
+   size_t* total;
+
+   void operator()(const char*, const size_t size) const { *total += size; }
+};
+
+// Into space already sized by serialized_size(), so without bounds checks.
+struct CopyTo final
+{
+   char** cur;
+
+   void operator()(const char* const data, const size_t size) const {
+      memcpy(*cur, data, size);
+      *cur += size;
+   }
+};
+
+// Calls an emitter of any type, for a CacheUpTo whose own type can't depend
+// on it.
+struct ErasedEmit final
+{
+   const void* emit;
+   void (*fn_emit)(const void* emit, const char* data, size_t size);
+
+   template<typename EmitT>
+   static void call(const void* const emit, const char* const data,
+                    const size_t size) {
+      (*static_cast<const EmitT*>(emit))(data, size);
+   }
+
+   void operator()(const char* const data, const size_t size) const {
+      fn_emit(emit, data, size);
+   }
+};
+
+// Fills a cache's `bytes` until they'd pass its max_fragment, then hands
+// those and everything after to `next`.
+template<typename EmitT>
+struct CacheUpTo final
+{
+   WriteCache* cache;
+   bool* overflowed;
+   EmitT next;
+
+   void operator()(const char* const data, const size_t size) const {
+      auto& bytes = cache->bytes;
+      if (!*overflowed) {
+         if (bytes.size() + size <= cache->max_fragment) {
+            bytes.append(data, size);
+            return;
+         }
+         *overflowed = true;
+         next(bytes.data(), bytes.size());
+         std::string().swap(bytes);
+      }
+      next(data, size);
+   }
+};
+
+// The outermost CacheUpTo calls the caller's emitter directly, since after
+// an overflow it sees every fragment. Ones nested in it go through
+// ErasedEmit, so their types don't nest with the tree.
+template<typename EmitT>
+static CacheUpTo<EmitT>
+cache_up_to(WriteCache* const cache, bool* const overflowed,
+            const EmitT& fn_emit)
+{
+   return {cache, overflowed, fn_emit};
+}
+
+template<typename EmitT>
+static CacheUpTo<ErasedEmit>
+cache_up_to(WriteCache* const cache, bool* const overflowed,
+            const CacheUpTo<EmitT>& fn_emit)
 {
+   return {cache, overflowed,
+           ErasedEmit{&fn_emit, &ErasedEmit::call<CacheUpTo<EmitT>>}};
+}
+
+template<typename EmitT>
+static void
+write_node(const Val& root, const std::string& indent, size_t depth,
+           const EmitT& fn_emit);
+
+// Writes through `fn_emit(const char* data, size_t size)`, nesting `depth`
+// levels past `indent`, without building any temporaries unless `root` has a
+// write cache to fill.
+template<typename EmitT>
+static void
+write_impl(const Val& root, const std::string& indent, const size_t depth,
+           const EmitT& fn_emit)
+{
+   const auto cache = WriteCache::of(root);
+   if (!cache || !(root.is_dict() || root.is_list())) {
+      write_node(root, indent, depth, fn_emit);
+      return;
+   }
+
+   if (cache->valid && cache->source) {
+      fn_emit(cache->source_begin, cache->source_size);
+      return;
+   }
+   if (cache->valid && cache->depth == depth && cache->indent == indent) {
+      fn_emit(cache->bytes.data(), cache->bytes.size());
+      return;
+   }
+   cache->source = nullptr;
+   WriteCache::attach_children(root);
+   if (cache->too_big) {
+      write_node(root, indent, depth, fn_emit);
+      return;
+   }
+
+   cache->bytes.clear();
+   bool overflowed = false;
+   write_node(root, indent, depth, cache_up_to(cache, &overflowed, fn_emit));
+   if (overflowed) {
+      cache->too_big = true;
+      return;
+   }
+   fn_emit(cache->bytes.data(), cache->bytes.size());
+   cache->indent = indent;
+   cache->depth = depth;
+   cache->valid = true;
+}
+
+template<typename EmitT>
+static void
+write_node(const Val& root, const std::string& indent, const size_t depth,
+           const EmitT& fn_emit)
+{
+   const auto fn_newline = [&](const size_t depth) {
+      fn_emit("\n", 1);
+      fn_emit(indent.data(), indent.size());
+      for (size_t i = 0; i < depth; ++i) {
+         fn_emit("   ", 3);
+      }
+   };
+
    if (root.is_dict()) {
       const auto& d = root.dict();
-      *out << "{";
+      fn_emit("{", 1);
       if (!d.size()) {
-         *out << "}";
+         fn_emit("}", 1);
          return;
       }
-      const auto indent_plus = indent + "   ";
       bool needsComma = false;
       for (const auto& kv : d) {
          if (needsComma) {
-            *out << ",";
+            fn_emit(",", 1);
          }
 
-         *out << "\n" << indent_plus << escape(kv.first) << ": ";
-         kv.second->write(out, indent_plus);
+         fn_newline(depth + 1);
+         // As escape(), in runs.
+         fn_emit("\"", 1);
+         auto itr = kv.first.data();
+         const auto end = kv.first.data() + kv.first.size();
+         while (true) {
+            const auto special = kernels().find_quote_or_backslash(itr, end);
+            fn_emit(itr, special - itr);
+            if (special == end)
+               break;
+            fn_emit("\\", 1);
+            fn_emit(special, 1);
+            itr = special + 1;
+         }
+         fn_emit("\": ", 3);
+         write_impl(*kv.second, indent, depth + 1, fn_emit);
 
          needsComma = true;
       }
-      *out << "\n" << indent << "}";
+      fn_newline(depth);
+      fn_emit("}", 1);
       return;
    }
 
    if (root.is_list()) {
       const auto& l = root.list();
-      *out << "[";
+      fn_emit("[", 1);
       if (!l.size()) {
-         *out << "]";
+         fn_emit("]", 1);
          return;
       }
-      const auto indent_plus = indent + "   ";
       bool needsComma = false;
       for (const auto& v : l) {
          if (needsComma) {
-            *out << ",";
+            fn_emit(",", 1);
          }
 
-         *out << "\n" << indent_plus;
-         v->write(out, indent_plus);
+         fn_newline(depth + 1);
+         write_impl(*v, indent, depth + 1, fn_emit);
 
          needsComma = true;
       }
-      *out << "\n" << indent << "]";
+      fn_newline(depth);
+      fn_emit("]", 1);
       return;
    }
 
-   *out << root.val();
+   const auto& val = root.val();
+   fn_emit(val.data(), val.size());
+}
+
+void
+write(const Val& root, std::ostream* const out, const std::string& indent)
+{
+   write_impl(root, indent, 0, [&](const char* const data, const size_t size) {
+      out->write(data, size);
+   });
+}
+
+size_t
+serialized_size(const Val& root, const std::string& indent)
+{
+   size_t size = 0;
+   write_impl(root, indent, 0, CountTo{&size});
+   return size;
+}
+
+void
+write(const Val& root, std::string* const out, const std::string& indent)
+{
+   // Counting first costs about a third of the write, so it only pays when
+   // it saves growing a fresh string through several reallocations.
+   static const auto INLINE_CAPACITY = std::string().capacity();
+   if (out->capacity() > INLINE_CAPACITY) {
+      write_impl(root, indent, 0, AppendTo{out});
+      return;
+   }
+   const auto begin = out->size();
+   out->resize(begin + serialized_size(root, indent));
+   auto cur = &(*out)[0] + begin;
+   write_impl(root, indent, 0, CopyTo{&cur});
+}
+
+bool
+write_file(const Val& root, const std::string& path, const std::string& indent,
+           std::string* const out_err)
+{
+   const auto size = serialized_size(root, indent);
+   const auto fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0) {
+      *out_err = "Can't open " + path + ": " + strerror(errno);
+      return false;
+   }
+   if (!size) {
+      close(fd);
+      return true;
+   }
+   // Allocated rather than just sized, so a full disk fails here instead of
+   // raising SIGBUS on a store through the mapping.
+   const auto alloc_err = posix_fallocate(fd, 0, off_t(size));
+   if (alloc_err) {
+      *out_err = "Can't allocate " + path + ": " + strerror(alloc_err);
+      close(fd);
+      return false;
+   }
+   const auto map = mmap(nullptr, size, PROT_WRITE, MAP_SHARED, fd, 0);
+   const auto map_errno = errno;
+   close(fd);
+   if (map == MAP_FAILED) {
+      *out_err = "Can't map " + path + ": " + strerror(map_errno);
+      return false;
+   }
+   auto cur = static_cast<char*>(map);
+   write_impl(root, indent, 0, CopyTo{&cur});
+   munmap(map, size);
+   return true;
 }
 
 // -
 
 bool
-Val::as_number(double* const out) const
+parse_number(const char* const begin, const char* const end, double* const out)
 {
-   auto stream = std::istringstream(val_);
+   NumberParts parts;
+   if (scan_number(begin, end, &parts) != end)
+      return false;
+
+   // When the mantissa and power of ten are both exactly representable, one
+   // multiply or divide is correctly rounded.
+   static const double EXACT_POWERS_OF_TEN[] = {
+      1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+   };
+   if (!parts.overflowed && parts.mantissa <= (uint64_t(1) << 53) &&
+       -22 <= parts.exp10 && parts.exp10 <= 22)
+   {
+      auto ret = double(parts.mantissa);
+      if (parts.exp10 < 0) {
+         ret /= EXACT_POWERS_OF_TEN[-parts.exp10];
+      } else {
+         ret *= EXACT_POWERS_OF_TEN[parts.exp10];
+      }
+      *out = (parts.negative ? -ret : ret);
+      return true;
+   }
+
+   auto stream = std::istringstream(std::string(begin, end));
 
    // Set the C locale, otherwise 1.5 parses as 1.0 in decimal-comma locales!
    const auto locale = std::locale::classic();
@@ -350,6 +1115,141 @@ Val::as_number(double* const out) const
    return true;
 }
 
+// Plain integers are accumulated exactly, and anything with a fraction or
+// exponent goes through double, which is exact for integers up to 2^53.
+template<typename IntT>
+static bool
+parse_integer_impl(const char* const begin, const char* const end,
+                   IntT* const out)
+{
+   NumberParts parts;
+   if (scan_number(begin, end, &parts) != end)
+      return false;
+
+   const auto size = size_t(end - begin);
+   const bool is_plain = (!memchr(begin, '.', size) &&
+                          !memchr(begin, 'e', size) &&
+                          !memchr(begin, 'E', size));
+   if (is_plain) {
+      auto magnitude = parts.mantissa;
+      if (parts.overflowed) {
+         // Past 19 digits, so redo it with overflow checks.
+         magnitude = 0;
+         const auto digits = begin + (*begin == '-' || *begin == '+');
+         for (auto itr = digits; itr != end; ++itr) {
+            const auto digit = uint64_t(*itr - '0');
+            if (magnitude > (UINT64_MAX - digit) / 10)
+               return false;
+            magnitude = magnitude * 10 + digit;
+         }
+      }
+
+      const auto max = uint64_t(std::numeric_limits<IntT>::max());
+      if (parts.negative && magnitude) {
+         // The most negative value's magnitude is max + 1.
+         if (!std::numeric_limits<IntT>::is_signed || magnitude > max + 1)
+            return false;
+         *out = IntT(0 - magnitude);
+         return true;
+      }
+      if (magnitude > max)
+         return false;
+      *out = IntT(magnitude);
+      return true;
+   }
+
+   double d;
+   if (!parse_number(begin, end, &d) || d != std::floor(d) ||
+       std::abs(d) > double(uint64_t(1) << 53) ||
+       d < double(std::numeric_limits<IntT>::min()) ||
+       d > double(std::numeric_limits<IntT>::max()))
+   {
+      return false;
+   }
+   *out = IntT(d);
+   return true;
+}
+
+bool
+parse_integer(const char* const begin, const char* const end,
+              int64_t* const out)
+{
+   return parse_integer_impl(begin, end, out);
+}
+
+bool
+parse_integer(const char* const begin, const char* const end,
+              uint64_t* const out)
+{
+   return parse_integer_impl(begin, end, out);
+}
+
+bool
+Val::as_number(double* const out) const
+{
+   return parse_number(val_.data(), val_.data() + val_.size(), out);
+}
+
+// -
+
+bool
+get_value(const Val& val, bool* const out)
+{
+   if (val.val() == "true") {
+      *out = true;
+   } else if (val.val() == "false") {
+      *out = false;
+   } else {
+      return false;
+   }
+   return true;
+}
+
+bool
+get_value(const Val& val, std::nullptr_t* const out)
+{
+   *out = nullptr;
+   return val.val() == "null";
+}
+
+bool
+get_value(const Val& val, int64_t* const out)
+{
+   const auto& v = val.val();
+   return parse_integer(v.data(), v.data() + v.size(), out);
+}
+
+bool
+get_value(const Val& val, uint64_t* const out)
+{
+   const auto& v = val.val();
+   return parse_integer(v.data(), v.data() + v.size(), out);
+}
+
+bool
+get_value(const Val& val, double* const out)
+{
+   return val.as_number(out);
+}
+
+bool
+get_value(const Val& val, float* const out)
+{
+   double x;
+   if (!val.as_number(&x) || std::abs(x) > std::numeric_limits<float>::max())
+      return false;
+   *out = float(x);
+   return true;
+}
+
+bool
+get_value(const Val& val, std::string* const out)
+{
+   return val.val().size() && val.val()[0] == '"' && val.as_string(out);
+}
+
+// -
+
 void
 Val::val(const double x)
 {
@@ -360,7 +1260,256 @@ Val::val(const double x)
 
    stream << x;
 
-   val() = stream.str();
+   set_val(stream.str());
+}
+
+// -
+
+Val::~Val()
+{
+   std::vector<std::unique_ptr<Val>> pending;
+   take_children(&pending);
+   while (pending.size()) {
+      const auto cur = std::move(pending.back());
+      pending.pop_back();
+      cur->take_children(&pending);
+   }
+   WriteCache::set(this, nullptr);
+}
+
+// Heap bytes of `s` that hold text, and that are spare capacity.
+static void
+add_string_usage(const std::string& s, size_t* const out_used,
+                 size_t* const out_slack)
+{
+   static const auto INLINE_CAPACITY = std::string().capacity();
+   if (s.capacity() <= INLINE_CAPACITY)
+      return;
+   *out_used += s.size() + 1;
+   *out_slack += s.capacity() - s.size();
+}
+
+MemoryUsage
+Val::memory_usage() const
+{
+   // A hash entry is the key/value pair plus a next pointer and cached hash.
+   typedef decltype(dict_)::value_type DictEntry;
+   const size_t DICT_ENTRY_SIZE = sizeof(DictEntry) + sizeof(void*) +
+                                  sizeof(size_t);
+
+   MemoryUsage ret;
+   std::vector<const Val*> pending = {this};
+   while (pending.size()) {
+      const auto cur = pending.back();
+      pending.pop_back();
+      ret.nodes += sizeof(Val);
+
+      add_string_usage(cur->val_, &ret.scalars, &ret.slack);
+      if (const auto cache = WriteCache::of(*cur)) {
+         ret.write_cache += sizeof(WriteCache) + cache->bytes.capacity();
+      }
+
+      // A single bucket is stored inline.
+      if (cur->dict_.bucket_count() > 1) {
+         ret.containers += cur->dict_.bucket_count() * sizeof(void*);
+      }
+      ret.containers += cur->dict_.size() * DICT_ENTRY_SIZE;
+      for (const auto& kv : cur->dict_) {
+         add_string_usage(kv.first, &ret.keys, &ret.slack);
+         pending.push_back(kv.second.get());
+      }
+
+      ret.containers += cur->list_.size() * sizeof(cur->list_[0]);
+      ret.slack += (cur->list_.capacity() - cur->list_.size()) *
+                   sizeof(cur->list_[0]);
+      for (const auto& child : cur->list_) {
+         pending.push_back(child.get());
+      }
+   }
+   return ret;
+}
+
+void
+Val::enable_write_cache(const size_t max_fragment)
+{
+   // Children get theirs as they're first written.
+   WriteCache::create(this, max_fragment)->max_fragment = max_fragment;
+}
+
+void
+Val::disable_write_cache()
+{
+   std::vector<Val*> pending = {this};
+   while (pending.size()) {
+      const auto cur = pending.back();
+      pending.pop_back();
+      if (!cur->write_cache_)
+         continue;
+      WriteCache::set(cur, nullptr);
+      for (auto& kv : cur->dict_) {
+         pending.push_back(kv.second.get());
+      }
+      for (auto& child : cur->list_) {
+         pending.push_back(child.get());
+      }
+   }
+}
+
+void
+Val::invalidate_write_cache()
+{
+   // The cache is this container's, or a scalar's container's, so always
+   // mark it. The change may have shrunk a too_big one enough to cache, so
+   // clear that too, and let write() find out. Past a cache that's neither,
+   // the rest have been cleared already.
+   write_cache_->valid = false;
+   write_cache_->too_big = false;
+   auto cache = write_cache_->parent;
+   while (cache && (cache->valid || cache->too_big)) {
+      cache->valid = false;
+      cache->too_big = false;
+      cache = cache->parent;
+   }
+}
+
+void
+Val::shrink_to_fit()
+{
+   std::vector<Val*> pending = {this};
+   while (pending.size()) {
+      const auto cur = pending.back();
+      pending.pop_back();
+
+      cur->val_.shrink_to_fit();
+      if (cur->dict_.size()) {
+         cur->dict_.rehash(0); // Fewest buckets within the max load factor.
+      } else if (cur->dict_.bucket_count() > 1) {
+         // rehash() never goes back to the inline bucket.
+         decltype(cur->dict_)().swap(cur->dict_);
+      }
+      for (auto& kv : cur->dict_) {
+         pending.push_back(kv.second.get());
+      }
+      cur->list_.shrink_to_fit();
+      for (auto& child : cur->list_) {
+         pending.push_back(child.get());
+      }
+   }
+}
+
+void
+Val::take_children(std::vector<std::unique_ptr<Val>>* const out)
+{
+   const auto fn_take = [&](std::unique_ptr<Val>& child) {
+      if (!child)
+         return;
+      if (child->dict_.size() || child->list_.size()) {
+         out->push_back(std::move(child));
+      }
+   };
+
+   for (auto& kv : dict_) {
+      fn_take(kv.second);
+   }
+   dict_.clear();
+
+   for (auto& child : list_) {
+      fn_take(child);
+   }
+   list_.clear();
+}
+
+// -
+
+namespace {
+
+class Reclaimer final
+{
+   std::mutex mutex_;
+   std::condition_variable cond_var_;
+   std::deque<std::unique_ptr<Val>> queue_;
+
+public:
+   // Leaked on purpose: the thread may still be freeing at exit.
+   static Reclaimer* get() {
+      static const auto instance = [](){
+         const auto ret = new Reclaimer;
+         std::thread([=](){ ret->run(); }).detach();
+         return ret;
+      }();
+      return instance;
+   }
+
+   void push(std::unique_ptr<Val> val) {
+      {
+         const std::lock_guard<std::mutex> lock(mutex_);
+         queue_.push_back(std::move(val));
+      }
+      cond_var_.notify_one();
+   }
+
+private:
+   void run() {
+      while (true) {
+         std::unique_ptr<Val> val;
+         {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cond_var_.wait(lock, [&](){ return queue_.size(); });
+            val = std::move(queue_.front());
+            queue_.pop_front();
+         }
+         val = nullptr;
+      }
+   }
+};
+
+} // namespace
+
+void
+destroy_async(std::unique_ptr<Val> val)
+{
+   if (!val)
+      return;
+   Reclaimer::get()->push(std::move(val));
+}
+
+void
+destroy_parallel(std::unique_ptr<Val> val, const size_t thread_count)
+{
+   if (!val)
+      return;
+
+   // Split the top of the tree into enough subtrees to keep every thread
+   // busy, then free those concurrently.
+   std::vector<std::unique_ptr<Val>> subtrees;
+   val->take_children(&subtrees);
+   val = nullptr;
+
+   const auto target_count = thread_count * 8;
+   size_t split_pos = 0;
+   while (subtrees.size() < target_count && split_pos < subtrees.size()) {
+      subtrees[split_pos]->take_children(&subtrees);
+      split_pos += 1;
+   }
+
+   std::atomic<size_t> next(0);
+   const auto fn_worker = [&]() {
+      while (true) {
+         const auto i = next.fetch_add(1);
+         if (i >= subtrees.size())
+            return;
+         subtrees[i] = nullptr;
+      }
+   };
+
+   std::vector<std::thread> threads;
+   for (size_t i = 1; i < thread_count; ++i) {
+      threads.push_back(std::thread(fn_worker));
+   }
+   fn_worker();
+   for (auto& t : threads) {
+      t.join();
+   }
 }
 
 // -
@@ -391,6 +1540,7 @@ Val::operator[](const std::string& x) const
 std::unique_ptr<Val>&
 Val::operator[](const std::string& x)
 {
+   touch();
    set_dict();
    auto& val = dict_[x];
    val.reset(new Val);
@@ -410,6 +1560,7 @@ Val::operator[](const size_t i) const
 std::unique_ptr<Val>&
 Val::operator[](const size_t i)
 {
+   touch();
    set_list();
    while (i >= list_.size()) {
       list_.push_back(std::unique_ptr<Val>(new Val));
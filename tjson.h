@@ -1,32 +1,217 @@
 #ifndef TJSON_H
 #define TJSON_H
 
+#include <cstdint>
+#include <functional>
 #include <iosfwd>
 #include <memory>
+#include <limits>
 #include <string>
+#include <type_traits>
 #include <unordered_map>
 #include <vector>
 
 namespace tjson {
 
-class TokenGen;
 class Val;
 
+struct Span final
+{
+   const char* begin;
+   const char* end;
+};
+
+struct Token final
+{
+   enum class Type : uint8_t {
+      MALFORMED = '?',
+      WHITESPACE = '_',
+      STRING = '"',
+      WORD = 'a',
+      SYMBOL = '$',
+   };
+
+   const char* begin;
+   const char* end;
+   uint64_t line_num;
+   uint64_t line_pos;
+   Type type;
+
+   bool operator==(const char* r) const;
+
+   std::string str() const { return std::string(begin, end); }
+
+   // Formats the same "Error: L1:2: Expected X, got: ..." message that read()
+   // reports.
+   std::string expected_err(const char* expected) const;
+};
+
+// Never allocates.
+class TokenGen final
+{
+   Token meta_token_;
+
+public:
+   TokenGen(const char* const begin, const char* const end)
+      : meta_token_{begin, end, 1, 1, Token::Type::MALFORMED}
+   { }
+
+   // Resumes at `pos.begin`, counting lines from `pos`'s line_num/line_pos.
+   explicit TokenGen(const Token& pos)
+      : meta_token_{pos.begin, pos.end, pos.line_num, pos.line_pos,
+                    Token::Type::MALFORMED}
+   { }
+
+   Token Next();
+   Token NextNonWS();
+};
+
+// Tokenizes input that arrives in chunks, holding only the current chunk and
+// any token that straddles it, so arbitrarily large inputs stream through in
+// bounded memory. Tokens are only valid until the next call to Next*().
+// At the end of input, Next*() returns an empty MALFORMED token.
+class TokenStream final
+{
+public:
+   // Writes up to `size` bytes to `dest`, returning how many. Returning 0
+   // signals the end of input.
+   typedef std::function<size_t(char* dest, size_t size)> ReadFn;
+
+   // A token still unfinished at this size is MALFORMED, rather than
+   // buffered without bound.
+   static const size_t MAX_TOKEN_SIZE = size_t(1) << 26;
+
+private:
+   const ReadFn fn_read_;
+   std::vector<char> buf_;
+   size_t buf_size_ = 0;
+   bool eof_ = false;
+   TokenGen tok_gen_;
+
+public:
+   explicit TokenStream(const ReadFn& fn_read, size_t chunk_size = 1 << 16);
+
+   Token Next();
+   Token NextNonWS();
+
+private:
+   void Refill(const Token& from);
+};
+
 std::unique_ptr<Val> read(const char* begin, const char* end,
                           std::string* out_err);
 
 std::unique_ptr<Val> read(TokenGen* tok_gen,
                           std::string* out_err);
 
+// Reads like read(), but keeps `text` alive and has each container remember
+// its span of it, as a write cache (see Val::enable_write_cache()). So write()
+// emits any container that hasn't changed since as a slice of `text`, in its
+// original layout, and only re-formats the path down to each change.
+std::unique_ptr<Val> read_retaining(std::shared_ptr<const std::string> text,
+                                    std::string* out_err,
+                                    size_t max_fragment = 1 << 16);
+
+// Checks that [begin, end) starts with a well-formed value, without building
+// it. Only allocates to report an error, or for absurdly deep nesting.
+bool validate(const char* begin, const char* end, std::string* out_err);
+
+// Whether [begin, end) is well-formed UTF-8, with no overlong encodings or
+// surrogates.
+bool validate_utf8(const char* begin, const char* end);
+
+// The exact number of bytes write() produces for `root`.
+size_t serialized_size(const Val& root, const std::string& indent);
+
 void write(const Val& root, std::ostream* stream, const std::string& indent);
+// Appends to `out`. Into a fresh string, it's sized up front by
+// serialized_size(), so it allocates once, with no slack. A reused buffer,
+// one already holding heap capacity, is written in one pass instead, and
+// only allocates if it needs to grow.
+void write(const Val& root, std::string* out, const std::string& indent);
+// Replaces the file at `path`, allocated up front and filled through a
+// mapping. Returns false and sets `*out_err` if that fails, including when
+// the disk is too full to hold it.
+bool write_file(const Val& root, const std::string& path,
+                const std::string& indent, std::string* out_err);
+
+// -
+
+// Holds the scratch state that each read() call would otherwise set up and
+// tear down, so that reading many documents through one Reader amortizes it.
+// Not thread-safe; use one Reader per thread.
+class Reader final
+{
+   std::string key_scratch_;
+   std::shared_ptr<const std::string> source_; // Only in read_retaining().
+   size_t max_fragment_ = 0;
+
+public:
+   std::unique_ptr<Val> read(const char* begin, const char* end,
+                             std::string* out_err);
+   std::unique_ptr<Val> read(TokenGen* tok_gen, std::string* out_err);
+   std::unique_ptr<Val> read_retaining(std::shared_ptr<const std::string> text,
+                                       std::string* out_err,
+                                       size_t max_fragment = 1 << 16);
+};
+
+struct ReadResult final
+{
+   std::unique_ptr<Val> val;
+   std::string err; // Set iff !val.
+};
+
+// Reads each of `docs` as a separate document into the matching slot of
+// `out`, which is resized to fit and can be reused across batches.
+// With `thread_count > 1`, docs are handed out in blocks to that many
+// threads, each with its own Reader.
+void read_batch(const std::vector<Span>& docs, std::vector<ReadResult>* out,
+                size_t thread_count = 1);
+
+// -
+
+// Hands `val` to a background thread to free, so that tearing down a large
+// tree never stalls the caller.
+void destroy_async(std::unique_ptr<Val> val);
+
+// Frees `val` on `thread_count` threads, returning once it's gone.
+void destroy_parallel(std::unique_ptr<Val> val, size_t thread_count);
 
 // -
 
 std::string escape(const std::string& in);
 bool unescape(const std::string& in, std::string* out);
+bool unescape(const char* begin, const char* end, std::string* out);
+
+// Parses a JSON number (optionally with a leading '+'), which must span all of
+// [begin, end).
+bool parse_number(const char* begin, const char* end, double* out);
+
+// Parses a number with an exact integer value that fits, like "-12" or "1e3".
+// Plain integers are parsed directly, so they keep all 64 bits.
+bool parse_integer(const char* begin, const char* end, int64_t* out);
+bool parse_integer(const char* begin, const char* end, uint64_t* out);
 
 // -
 
+// Heap bytes held by a Val tree, by what they hold. Hash table overhead is
+// estimated from libstdc++'s layout, so treat totals as close, not exact.
+struct MemoryUsage final
+{
+   size_t nodes = 0;      // The Vals themselves, including the root.
+   size_t keys = 0;       // Dict key text.
+   size_t scalars = 0;    // Scalar text, as in val().
+   size_t containers = 0; // Hash buckets and entries, and list arrays.
+   size_t slack = 0;      // Reserved but unused capacity in any of the above.
+   size_t write_cache = 0; // See Val::enable_write_cache().
+
+   size_t total() const {
+      return nodes + keys + scalars + containers + slack + write_cache;
+   }
+};
+
+struct WriteCache;
+
 class Val
 {
 public:
@@ -40,10 +225,31 @@ private:
    bool is_dict_ = false;
    bool is_list_ = false;
 
+   // A container's own cache, or for a scalar, its container's, so changing
+   // it invalidates that. Counted, since scalars share their container's.
+   WriteCache* write_cache_ = nullptr;
+   friend struct WriteCache;
+   friend class Reader; // Adds children without operator[]'s placeholders.
+
 private:
    void reset();
 
+   // Called before any change, so cached serializations stay correct.
+   void touch() {
+      if (write_cache_) {
+         invalidate_write_cache();
+      }
+   }
+   void invalidate_write_cache();
+
 public:
+   // Moves out any children that have children of their own, and frees the
+   // rest. Lets a tree be torn down without recursing per level.
+   void take_children(std::vector<std::unique_ptr<Val>>* out);
+
+   Val() = default;
+   ~Val();
+
    // const
    bool operator!() const { return !is_dict_ && !is_list_ && !val_.size(); }
    bool is_dict() const { return is_dict_; }
@@ -60,16 +266,47 @@ public:
    void write(std::ostream* stream, const std::string& indent) const {
       tjson::write(*this, stream, indent);
    }
+   void write(std::string* out, const std::string& indent) const {
+      tjson::write(*this, out, indent);
+   }
 
    bool as_string(std::string* const out) const {
       return unescape(val_, &*out);
    }
    bool as_number(double* out) const;
 
+   // Typed access, for any T that get_value() below supports. get_if() leaves
+   // `*out` alone unless the value converts, and get() returns T() if not.
+   template<typename T>
+   bool get_if(T* const out) const { return get_value(*this, out); }
+   template<typename T>
+   T value_or(T fallback) const {
+      T ret{};
+      return get_if(&ret) ? ret : fallback;
+   }
+   template<typename T>
+   T get() const { return value_or(T()); }
+
+   MemoryUsage memory_usage() const;
+
    // non-const
 
+   // Releases slack capacity throughout the tree.
+   void shrink_to_fit();
+
+   // Opt-in, for large trees re-written after small changes: Each container
+   // keeps its last serialization, up to `max_fragment` bytes, and write()
+   // reuses it until a change through this non-const API discards it and
+   // those of its ancestors. So writing costs roughly the size of what
+   // changed, plus the containers too big to cache. Don't hold references
+   // from the non-const accessors across a write(), and don't write one
+   // cached tree from several threads at once.
+   void enable_write_cache(size_t max_fragment = 1 << 16);
+   void disable_write_cache();
+
    void set_dict() {
       if (!is_dict_) {
+         touch();
          reset();
          is_dict_ = true;
       }
@@ -77,6 +314,7 @@ public:
 
    void set_list() {
       if (!is_list_) {
+         touch();
          reset();
          is_list_ = true;
       }
@@ -87,20 +325,95 @@ public:
 
    // -
 
-   auto& val() {
+   // The only ways to change a scalar, so reads through the const val()
+   // above leave write caches alone. set_val() takes JSON text, as val()
+   // returns it; val(x) escapes `x` as a string.
+   void set_val(std::string x) {
+      touch();
       if (!val_.size()) {
          reset();
       }
-      return val_;
+      val_ = std::move(x);
    }
 
    void val(const std::string& x) {
-      val() = std::move(escape(x));
+      set_val(escape(x));
    }
 
    void val(double x);
 };
 
+// -
+// Conversions for Val::get_if(), chosen at compile time by overload:
+// * bool: `true` or `false`.
+// * std::nullptr_t: `null`.
+// * Integral types: A number whose exact value fits, so 1.5 or 300 for a
+//   uint8_t fail rather than truncate.
+// * float, double: Any number, though one outside float's range fails.
+// * std::string: A string, unescaped.
+// * std::vector<T>, std::unordered_map<std::string, T>: A list or dict whose
+//   every member converts to T.
+
+bool get_value(const Val& val, bool* out);
+bool get_value(const Val& val, std::nullptr_t* out);
+bool get_value(const Val& val, int64_t* out);
+bool get_value(const Val& val, uint64_t* out);
+bool get_value(const Val& val, double* out);
+bool get_value(const Val& val, float* out);
+bool get_value(const Val& val, std::string* out);
+
+template<typename T>
+typename std::enable_if<std::is_integral<T>::value &&
+                        !std::is_same<T, bool>::value, bool>::type
+get_value(const Val& val, T* const out)
+{
+   typedef typename std::conditional<std::is_signed<T>::value,
+                                     int64_t, uint64_t>::type WideT;
+   WideT x;
+   if (!get_value(val, &x) ||
+       x < WideT(std::numeric_limits<T>::min()) ||
+       x > WideT(std::numeric_limits<T>::max()))
+   {
+      return false;
+   }
+   *out = T(x);
+   return true;
+}
+
+template<typename T>
+bool
+get_value(const Val& val, std::vector<T>* const out)
+{
+   if (!val.is_list())
+      return false;
+   std::vector<T> ret;
+   ret.reserve(val.list().size());
+   for (const auto& item : val.list()) {
+      // Not through &ret[i], which std::vector<bool> can't give.
+      T x;
+      if (!get_value(*item, &x))
+         return false;
+      ret.push_back(std::move(x));
+   }
+   *out = std::move(ret);
+   return true;
+}
+
+template<typename T>
+bool
+get_value(const Val& val, std::unordered_map<std::string, T>* const out)
+{
+   if (!val.is_dict())
+      return false;
+   std::unordered_map<std::string, T> ret;
+   for (const auto& kv : val.dict()) {
+      if (!get_value(*kv.second, &ret[kv.first]))
+         return false;
+   }
+   *out = std::move(ret);
+   return true;
+}
+
 } // namespace tjson
 
 #endif // TJSON_H
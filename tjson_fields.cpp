@@ -0,0 +1,262 @@
+#include "tjson_fields.h"
+
+#include "tjson_kernels.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace tjson {
+
+KeyMatcher::KeyMatcher(std::vector<std::string> keys)
+   : keys_(std::move(keys))
+{
+   size_t slot_count = 1;
+   while (slot_count < keys_.size() * 2) {
+      slot_count *= 2;
+   }
+
+   // Try seeds until no two keys share a slot, growing the table if that's
+   // taking a while.
+   while (true) {
+      for (uint64_t seed = 0; seed < 1000; ++seed) {
+         slots_.assign(slot_count, 0);
+         bool ok = true;
+         for (size_t i = 0; ok && i < keys_.size(); ++i) {
+            const auto& key = keys_[i];
+            const auto h = hash_key(key.data(), key.data() + key.size(), seed);
+            auto& slot = slots_[h & (slot_count - 1)];
+            if (!slot) {
+               slot = uint32_t(i + 1);
+            } else if (keys_[slot - 1] != key) {
+               ok = false;
+            }
+         }
+         if (ok) {
+            seed_ = seed;
+            mask_ = slot_count - 1;
+            return;
+         }
+      }
+      slot_count *= 2;
+   }
+}
+
+size_t
+KeyMatcher::match(const Token& tok) const
+{
+   const auto inner = tok.begin + 1;
+   const auto inner_end = tok.end - 1;
+   const auto inner_size = size_t(inner_end - inner);
+
+   if (memchr(inner, '\\', inner_size)) {
+      // Escaped keys are rare, so just compare them the slow way.
+      std::string unescaped;
+      if (!unescape(tok.begin, tok.end, &unescaped))
+         return NO_MATCH;
+      for (size_t i = 0; i < keys_.size(); ++i) {
+         if (keys_[i] == unescaped)
+            return i;
+      }
+      return NO_MATCH;
+   }
+
+   const auto slot = slots_[hash_key(inner, inner_end, seed_) & mask_];
+   if (!slot)
+      return NO_MATCH;
+   const auto& key = keys_[slot - 1];
+   if (key.size() != inner_size || memcmp(key.data(), inner, inner_size))
+      return NO_MATCH;
+   return slot - 1;
+}
+
+// -
+
+/*static*/ bool
+RecordFilter::parse(const std::string& expr, RecordFilter* const out,
+                    std::string* const out_err)
+{
+   const auto eq = expr.find('=');
+   if (eq == std::string::npos || !eq) {
+      *out_err = "Error: Expected KEY=VALUE, got: \"" + expr + "\".";
+      return false;
+   }
+   out->key_ = expr.substr(0, eq);
+   const auto value = expr.substr(eq + 1);
+
+   TokenGen tokens(value.data(), value.data() + value.size());
+   const auto tok = tokens.NextNonWS();
+   const auto rest = tokens.NextNonWS();
+   const auto is_whole = (rest.begin == value.data() + value.size());
+   double number = 0;
+   if (is_whole && tok.type == Token::Type::STRING &&
+       unescape(tok.begin, tok.end, &out->text_))
+   {
+      out->type_ = Token::Type::STRING;
+   } else if (is_whole && (tok == "true" || tok == "false" || tok == "null")) {
+      out->type_ = Token::Type::WORD;
+      out->text_ = tok.str();
+   } else if (is_whole && tok.type == Token::Type::WORD &&
+              parse_number(tok.begin, tok.end, &number))
+   {
+      out->type_ = Token::Type::WORD;
+      out->text_ = tok.str();
+      out->is_number_ = true;
+      out->number_ = number;
+   } else {
+      out->type_ = Token::Type::STRING;
+      out->text_ = value;
+   }
+
+   if (out->is_number_) {
+      out->needle_ = escape(out->key_);
+   } else if (out->type_ == Token::Type::STRING) {
+      out->needle_ = escape(out->text_);
+   } else {
+      out->needle_ = out->text_;
+   }
+   return true;
+}
+
+bool
+RecordFilter::matches(const char* const begin, const char* const end,
+                      bool* const out_match, std::string* const out_err) const
+{
+   TokenGen tokens(begin, end);
+   return matches(&tokens, out_match, out_err);
+}
+
+bool
+RecordFilter::matches(TokenGen* const tokens, bool* const out_match,
+                      std::string* const out_err) const
+{
+   // The record is the whole line, so anything after it is malformed rather
+   // than ignored.
+   if (!match_record(tokens, out_match, out_err))
+      return false;
+   const auto rest = tokens->NextNonWS();
+   if (rest.begin != rest.end) {
+      *out_err = rest.expected_err("end of line");
+      return false;
+   }
+   return true;
+}
+
+bool
+RecordFilter::match_record(TokenGen* const tokens, bool* const out_match,
+                           std::string* const out_err) const
+{
+   const auto fn_is_key = [&](const Token& tok) {
+      const auto inner = tok.begin + 1;
+      const auto inner_size = size_t(tok.end - tok.begin) - 2;
+      if (!memchr(inner, '\\', inner_size))
+         return inner_size == key_.size() &&
+                !memcmp(inner, key_.data(), inner_size);
+      std::string unescaped;
+      return unescape(tok.begin, tok.end, &unescaped) && unescaped == key_;
+   };
+   const auto fn_is_value = [&](const Token& tok) {
+      if (tok.type != type_)
+         return false;
+      if (is_number_) {
+         double number;
+         return parse_number(tok.begin, tok.end, &number) && number == number_;
+      }
+      if (type_ == Token::Type::WORD)
+         return size_t(tok.end - tok.begin) == text_.size() &&
+                !memcmp(tok.begin, text_.data(), text_.size());
+      std::string unescaped;
+      return unescape(tok.begin, tok.end, &unescaped) && unescaped == text_;
+   };
+
+   *out_match = false;
+   auto peek_gen = *tokens;
+   const auto open = peek_gen.NextNonWS();
+   if (!(open == "{")) {
+      // Not a dict, so not a match, but still an error if it's malformed.
+      return skip_value(tokens, out_err);
+   }
+   *tokens = peek_gen;
+
+   auto tok = tokens->NextNonWS();
+   if (tok == "}")
+      return true;
+   while (true) {
+      if (tok.type != Token::Type::STRING) {
+         *out_err = tok.expected_err("STRING");
+         return false;
+      }
+      const auto colon = tokens->NextNonWS();
+      if (!(colon == ":")) {
+         *out_err = colon.expected_err("\":\"");
+         return false;
+      }
+      if (fn_is_key(tok)) {
+         peek_gen = *tokens;
+         *out_match = fn_is_value(peek_gen.NextNonWS());
+      }
+      if (!skip_value(tokens, out_err))
+         return false;
+
+      tok = tokens->NextNonWS();
+      if (tok == "}")
+         return true;
+      if (!(tok == ",")) {
+         *out_err = tok.expected_err("\",\"");
+         return false;
+      }
+      tok = tokens->NextNonWS();
+   }
+}
+
+bool
+RecordFilter::filter_lines(const char* const begin, const char* const end,
+                           const std::function<void(const char*, const char*)>&
+                              fn_match,
+                           std::string* const out_err) const
+{
+   const auto& k = kernels();
+   const auto fn_line_end = [&](const char* const itr) {
+      const auto nl = (const char*)memchr(itr, '\n', size_t(end - itr));
+      return nl ? nl : end;
+   };
+
+   auto itr = begin;
+   const char* needle_at = nullptr; // The next one found, kept across lines.
+   while (itr != end) {
+      // Jump to the next line with the needle or a backslash in it.
+      if (!needle_at || needle_at < itr) {
+         needle_at = k.find_substring(itr, end, needle_.data(), needle_.size());
+      }
+      auto hit = needle_at;
+      if (const auto backslash = (const char*)memchr(itr, '\\',
+                                                     size_t(hit - itr)))
+      {
+         hit = backslash;
+      }
+      if (hit == end)
+         return true;
+      auto line_begin = hit;
+      while (line_begin != itr && line_begin[-1] != '\n') {
+         --line_begin;
+      }
+      const auto line_end = fn_line_end(hit);
+
+      TokenGen tokens(line_begin, line_end);
+      bool match;
+      if (!matches(&tokens, &match, out_err)) {
+         // Redo it knowing the line number, for the message.
+         const auto line_num = 1 + std::count(begin, line_begin, '\n');
+         TokenGen numbered(Token{line_begin, line_end, uint64_t(line_num), 1,
+                                 Token::Type::MALFORMED});
+         matches(&numbered, &match, out_err);
+         return false;
+      }
+      if (match) {
+         fn_match(line_begin, line_end);
+      }
+      itr = (line_end == end) ? end : line_end + 1;
+   }
+   return true;
+}
+
+} // namespace tjson
@@ -0,0 +1,216 @@
+#ifndef TJSON_FIELDS_H
+#define TJSON_FIELDS_H
+
+#include "tjson_walk.h"
+
+namespace tjson {
+
+// FNV-1a over [begin, end), with `seed` folded into the offset basis and a
+// final mix so the low bits are usable as a table index. constexpr, so hashes
+// of known keys can be computed at compile time.
+constexpr uint64_t
+hash_key(const char* const begin, const char* const end, const uint64_t seed)
+{
+   uint64_t h = 0xcbf29ce484222325 ^ (seed * 0x9e3779b97f4a7c15);
+   for (auto itr = begin; itr != end; ++itr) {
+      h = (h ^ uint8_t(*itr)) * 0x100000001b3;
+   }
+   h ^= h >> 32;
+   h *= 0xd6e8feb86659fd93;
+   h ^= h >> 32;
+   return h;
+}
+
+// Maps each of a fixed set of dict keys to its index in that set, for decoding
+// documents whose fields are known ahead of time. Construction searches for a
+// seed that hashes every key to its own slot, so matching a key token is one
+// hash, one load and one compare, without unescaping or building a Val.
+class KeyMatcher final
+{
+   std::vector<std::string> keys_;
+   std::vector<uint32_t> slots_; // Index into keys_ plus one, or 0 if empty.
+   uint64_t seed_ = 0;
+   uint64_t mask_ = 0;
+
+public:
+   static const size_t NO_MATCH = size_t(-1);
+
+   // Keys are unescaped. A repeated key matches its first index.
+   explicit KeyMatcher(std::vector<std::string> keys);
+
+   size_t size() const { return keys_.size(); }
+   const std::string& key(const size_t i) const { return keys_[i]; }
+
+   // Index of the key in the STRING token `tok`, or NO_MATCH.
+   size_t match(const Token& tok) const;
+};
+
+// Matches JSON Lines records whose top-level `key` has a given scalar value,
+// checking raw bytes before tokenizing anything: A line can only match if it
+// contains the value as written by escape() (for a number, which has many
+// spellings, the key instead), or else a backslash. Lines without are
+// skipped by one find_substring() kernel scan, unchecked.
+class RecordFilter final
+{
+   std::string key_; // Unescaped.
+   Token::Type type_ = Token::Type::WORD;
+   std::string text_; // Unescaped for STRING, else as written.
+   double number_ = 0;
+   bool is_number_ = false;
+   std::string needle_;
+
+public:
+   // `expr` is KEY=VALUE, where VALUE is a JSON scalar, or else taken as a
+   // string, so `name=bob` and `name="bob"` are the same filter.
+   static bool parse(const std::string& expr, RecordFilter* out,
+                     std::string* out_err);
+
+   // Sets `*out_match` to whether the record in [begin, end) is a dict whose
+   // `key` (the last one, if repeated) has the value. Returns false and sets
+   // `*out_err` if the record is malformed, or followed by anything but
+   // whitespace.
+   bool matches(const char* begin, const char* end, bool* out_match,
+                std::string* out_err) const;
+
+   // Calls `fn_match(begin, end)` with each matching line of [begin, end),
+   // not including its '\n'. Returns false and sets `*out_err` on the first
+   // malformed line that passes the prefilter, counting lines from 1.
+   bool filter_lines(const char* begin, const char* end,
+                     const std::function<void(const char*, const char*)>&
+                        fn_match,
+                     std::string* out_err) const;
+
+private:
+   bool matches(TokenGen* tokens, bool* out_match, std::string* out_err) const;
+   // Just the record, leaving `*tokens` after it.
+   bool match_record(TokenGen* tokens, bool* out_match,
+                     std::string* out_err) const;
+};
+
+// -
+// Typed binding: Each of these reads one value from `tokens`, failing with
+// `*out_err` set as read() would. They take a TokenGen, since an empty list is
+// detected by looking ahead on a copy.
+
+inline bool
+skip_value(TokenGen* const tokens, std::string* const out_err)
+{
+   struct SkipHandler final
+   {
+      bool OnOpen(const Token&) { return true; }
+      bool OnKey(const Token&) { return true; }
+      bool OnScalar(const Token&) { return true; }
+      bool OnClose(const Token&) { return true; }
+   } handler;
+   return walk(tokens, &handler, out_err);
+}
+
+inline bool
+read_string(TokenGen* const tokens, std::string* const out,
+            std::string* const out_err)
+{
+   const auto tok = tokens->NextNonWS();
+   if (tok.type != Token::Type::STRING) {
+      *out_err = tok.expected_err("STRING");
+      return false;
+   }
+   if (!unescape(tok.begin, tok.end, out)) {
+      *out_err = tok.expected_err("valid STRING");
+      return false;
+   }
+   return true;
+}
+
+inline bool
+read_number(TokenGen* const tokens, double* const out,
+            std::string* const out_err)
+{
+   const auto tok = tokens->NextNonWS();
+   if (tok.type != Token::Type::WORD ||
+       !parse_number(tok.begin, tok.end, out))
+   {
+      *out_err = tok.expected_err("NUMBER");
+      return false;
+   }
+   return true;
+}
+
+// Reads a list, calling `fn_item(tokens, out_err)` for each item, which must
+// read exactly that item.
+template<typename ItemFnT>
+bool
+read_items(TokenGen* const tokens, const ItemFnT& fn_item,
+           std::string* const out_err)
+{
+   const auto open = tokens->NextNonWS();
+   if (!(open == "[")) {
+      *out_err = open.expected_err("\"[\"");
+      return false;
+   }
+   auto gen_peek = *tokens;
+   if (gen_peek.NextNonWS() == "]") {
+      *tokens = gen_peek;
+      return true;
+   }
+   while (true) {
+      if (!fn_item(tokens, out_err))
+         return false;
+      const auto tok = tokens->NextNonWS();
+      if (tok == "]")
+         return true;
+      if (!(tok == ",")) {
+         *out_err = tok.expected_err("\",\"");
+         return false;
+      }
+   }
+}
+
+// Reads a dict, calling `fn_field(index, tokens, out_err)` for each key that
+// `matcher` knows, which must read exactly that key's value. Values of other
+// keys are checked and skipped.
+template<typename FieldFnT>
+bool
+read_fields(TokenGen* const tokens, const KeyMatcher& matcher,
+            const FieldFnT& fn_field, std::string* const out_err)
+{
+   const auto open = tokens->NextNonWS();
+   if (!(open == "{")) {
+      *out_err = open.expected_err("\"{\"");
+      return false;
+   }
+   auto tok = tokens->NextNonWS();
+   if (tok == "}")
+      return true;
+   while (true) {
+      if (tok.type != Token::Type::STRING) {
+         *out_err = tok.expected_err("STRING");
+         return false;
+      }
+      const auto index = matcher.match(tok);
+
+      const auto colon = tokens->NextNonWS();
+      if (!(colon == ":")) {
+         *out_err = colon.expected_err("\":\"");
+         return false;
+      }
+      if (index == KeyMatcher::NO_MATCH) {
+         if (!skip_value(tokens, out_err))
+            return false;
+      } else if (!fn_field(index, tokens, out_err)) {
+         return false;
+      }
+
+      tok = tokens->NextNonWS();
+      if (tok == "}")
+         return true;
+      if (!(tok == ",")) {
+         *out_err = tok.expected_err("\",\"");
+         return false;
+      }
+      tok = tokens->NextNonWS();
+   }
+}
+
+} // namespace tjson
+
+#endif // TJSON_FIELDS_H
@@ -0,0 +1,363 @@
+#include "tjson_kernels.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define TJSON_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+namespace tjson {
+
+static bool
+is_whitespace(const char c)
+{
+   return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Returns the end of the UTF-8 sequence at `itr`, or nullptr if it's invalid.
+static const char*
+next_utf8_char(const char* const itr, const char* const end)
+{
+   const auto c = uint8_t(*itr);
+   if (c < 0x80)
+      return itr + 1;
+
+   size_t extra;
+   uint32_t code_point;
+   uint32_t min_code_point;
+   if ((c & 0xe0) == 0xc0) {
+      extra = 1;
+      code_point = c & 0x1f;
+      min_code_point = 0x80;
+   } else if ((c & 0xf0) == 0xe0) {
+      extra = 2;
+      code_point = c & 0x0f;
+      min_code_point = 0x800;
+   } else if ((c & 0xf8) == 0xf0) {
+      extra = 3;
+      code_point = c & 0x07;
+      min_code_point = 0x10000;
+   } else {
+      return nullptr;
+   }
+   if (size_t(end - itr) <= extra)
+      return nullptr;
+
+   for (size_t i = 1; i <= extra; ++i) {
+      const auto cont = uint8_t(itr[i]);
+      if ((cont & 0xc0) != 0x80)
+         return nullptr;
+      code_point = (code_point << 6) | (cont & 0x3f);
+   }
+   // No overlong encodings, surrogates, or code points past Unicode's range.
+   if (code_point < min_code_point || code_point > 0x10ffff ||
+       (code_point >= 0xd800 && code_point <= 0xdfff))
+   {
+      return nullptr;
+   }
+   return itr + 1 + extra;
+}
+
+// -
+
+static const char*
+skip_whitespace_scalar(const char* begin, const char* const end)
+{
+   while (begin != end && is_whitespace(*begin)) {
+      ++begin;
+   }
+   return begin;
+}
+
+static const char*
+find_quote_or_backslash_scalar(const char* begin, const char* const end)
+{
+   while (begin != end && *begin != '"' && *begin != '\\') {
+      ++begin;
+   }
+   return begin;
+}
+
+static const char*
+find_substring_scalar(const char* begin, const char* const end,
+                      const char* const needle, const size_t needle_size)
+{
+   while (size_t(end - begin) >= needle_size) {
+      begin = (const char*)memchr(begin, needle[0],
+                                  size_t(end - begin) - needle_size + 1);
+      if (!begin)
+         return end;
+      if (!memcmp(begin, needle, needle_size))
+         return begin;
+      ++begin;
+   }
+   return end;
+}
+
+static bool
+validate_utf8_scalar(const char* begin, const char* const end)
+{
+   while (begin != end) {
+      begin = next_utf8_char(begin, end);
+      if (!begin)
+         return false;
+   }
+   return true;
+}
+
+static bool
+is_supported_always()
+{
+   return true;
+}
+
+// Only plain functions here, not lambdas, so these tables are constant-
+// initialized and usable from other static initializers.
+static const Kernels KERNELS_SCALAR = {
+   "scalar",
+   skip_whitespace_scalar,
+   find_quote_or_backslash_scalar,
+   find_substring_scalar,
+   validate_utf8_scalar,
+   is_supported_always,
+};
+
+// -
+
+#ifdef TJSON_X86_KERNELS
+
+// - SSE2
+
+static __m128i
+whitespace_mask_sse2(const __m128i v)
+{
+   return _mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                   _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+      _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                   _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+}
+
+static const char*
+skip_whitespace_sse2(const char* begin, const char* const end)
+{
+   for (; end - begin >= 16; begin += 16) {
+      const auto v = _mm_loadu_si128((const __m128i*)begin);
+      const auto non_ws = ~_mm_movemask_epi8(whitespace_mask_sse2(v)) & 0xffff;
+      if (non_ws)
+         return begin + __builtin_ctz(non_ws);
+   }
+   return skip_whitespace_scalar(begin, end);
+}
+
+static const char*
+find_quote_or_backslash_sse2(const char* begin, const char* const end)
+{
+   for (; end - begin >= 16; begin += 16) {
+      const auto v = _mm_loadu_si128((const __m128i*)begin);
+      const auto found = _mm_movemask_epi8(
+         _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                      _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))));
+      if (found)
+         return begin + __builtin_ctz(found);
+   }
+   return find_quote_or_backslash_scalar(begin, end);
+}
+
+// Compares a block against the needle's first and last chars at once, and
+// only checks the whole needle where both match.
+static const char*
+find_substring_sse2(const char* begin, const char* const end,
+                    const char* const needle, const size_t needle_size)
+{
+   const auto first = _mm_set1_epi8(needle[0]);
+   const auto last = _mm_set1_epi8(needle[needle_size - 1]);
+   for (; size_t(end - begin) >= 16 + needle_size - 1; begin += 16) {
+      const auto v_first = _mm_loadu_si128((const __m128i*)begin);
+      const auto v_last = _mm_loadu_si128(
+         (const __m128i*)(begin + needle_size - 1));
+      auto found = uint32_t(_mm_movemask_epi8(
+         _mm_and_si128(_mm_cmpeq_epi8(v_first, first),
+                       _mm_cmpeq_epi8(v_last, last))));
+      while (found) {
+         const auto candidate = begin + __builtin_ctz(found);
+         if (!memcmp(candidate, needle, needle_size))
+            return candidate;
+         found &= found - 1;
+      }
+   }
+   return find_substring_scalar(begin, end, needle, needle_size);
+}
+
+static bool
+validate_utf8_sse2(const char* begin, const char* const end)
+{
+   while (begin != end) {
+      // Skip ASCII a block at a time, then step through anything else.
+      if (end - begin >= 16) {
+         const auto v = _mm_loadu_si128((const __m128i*)begin);
+         if (!_mm_movemask_epi8(v)) {
+            begin += 16;
+            continue;
+         }
+      }
+      begin = next_utf8_char(begin, end);
+      if (!begin)
+         return false;
+   }
+   return true;
+}
+
+static const Kernels KERNELS_SSE2 = {
+   "sse2",
+   skip_whitespace_sse2,
+   find_quote_or_backslash_sse2,
+   find_substring_sse2,
+   validate_utf8_sse2,
+   is_supported_always, // Part of x86-64.
+};
+
+// - AVX2
+
+#define TJSON_AVX2 __attribute__((target("avx2")))
+
+TJSON_AVX2 static const char*
+skip_whitespace_avx2(const char* begin, const char* const end)
+{
+   for (; end - begin >= 32; begin += 32) {
+      const auto v = _mm256_loadu_si256((const __m256i*)begin);
+      const auto ws = _mm256_or_si256(
+         _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                         _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+         _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                         _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+      const auto non_ws = ~uint32_t(_mm256_movemask_epi8(ws));
+      if (non_ws)
+         return begin + __builtin_ctz(non_ws);
+   }
+   return skip_whitespace_sse2(begin, end);
+}
+
+TJSON_AVX2 static const char*
+find_quote_or_backslash_avx2(const char* begin, const char* const end)
+{
+   for (; end - begin >= 32; begin += 32) {
+      const auto v = _mm256_loadu_si256((const __m256i*)begin);
+      const auto found = uint32_t(_mm256_movemask_epi8(
+         _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                         _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')))));
+      if (found)
+         return begin + __builtin_ctz(found);
+   }
+   return find_quote_or_backslash_sse2(begin, end);
+}
+
+TJSON_AVX2 static const char*
+find_substring_avx2(const char* begin, const char* const end,
+                    const char* const needle, const size_t needle_size)
+{
+   const auto first = _mm256_set1_epi8(needle[0]);
+   const auto last = _mm256_set1_epi8(needle[needle_size - 1]);
+   for (; size_t(end - begin) >= 32 + needle_size - 1; begin += 32) {
+      const auto v_first = _mm256_loadu_si256((const __m256i*)begin);
+      const auto v_last = _mm256_loadu_si256(
+         (const __m256i*)(begin + needle_size - 1));
+      auto found = uint32_t(_mm256_movemask_epi8(
+         _mm256_and_si256(_mm256_cmpeq_epi8(v_first, first),
+                          _mm256_cmpeq_epi8(v_last, last))));
+      while (found) {
+         const auto candidate = begin + __builtin_ctz(found);
+         if (!memcmp(candidate, needle, needle_size))
+            return candidate;
+         found &= found - 1;
+      }
+   }
+   return find_substring_sse2(begin, end, needle, needle_size);
+}
+
+TJSON_AVX2 static bool
+validate_utf8_avx2(const char* begin, const char* const end)
+{
+   while (begin != end) {
+      if (end - begin >= 32) {
+         const auto v = _mm256_loadu_si256((const __m256i*)begin);
+         if (!_mm256_movemask_epi8(v)) {
+            begin += 32;
+            continue;
+         }
+      }
+      begin = next_utf8_char(begin, end);
+      if (!begin)
+         return false;
+   }
+   return true;
+}
+
+static bool
+is_supported_avx2()
+{
+   __builtin_cpu_init();
+   return bool(__builtin_cpu_supports("avx2"));
+}
+
+static const Kernels KERNELS_AVX2 = {
+   "avx2",
+   skip_whitespace_avx2,
+   find_quote_or_backslash_avx2,
+   find_substring_avx2,
+   validate_utf8_avx2,
+   is_supported_avx2,
+};
+
+#endif // TJSON_X86_KERNELS
+
+// -
+
+const std::vector<const Kernels*>&
+all_kernels()
+{
+   static const std::vector<const Kernels*> ret = {
+      &KERNELS_SCALAR,
+#ifdef TJSON_X86_KERNELS
+      &KERNELS_SSE2,
+      &KERNELS_AVX2,
+#endif
+   };
+   return ret;
+}
+
+static const Kernels*
+select_kernels()
+{
+   const auto& all = all_kernels();
+   if (const auto name = getenv("TJSON_KERNELS")) {
+      for (const auto& k : all) {
+         if (strcmp(k->name, name))
+            continue;
+         if (k->is_supported())
+            return k;
+         fprintf(stderr, "TJSON_KERNELS=%s is unsupported on this CPU.\n", name);
+         break;
+      }
+      fprintf(stderr, "Ignoring TJSON_KERNELS=%s.\n", name);
+   }
+
+   for (auto itr = all.rbegin(); itr != all.rend(); ++itr) {
+      if ((*itr)->is_supported())
+         return *itr;
+   }
+   return &KERNELS_SCALAR;
+}
+
+const Kernels&
+kernels()
+{
+   static const auto ret = select_kernels();
+   return *ret;
+}
+
+} // namespace tjson
@@ -0,0 +1,44 @@
+#ifndef TJSON_KERNELS_H
+#define TJSON_KERNELS_H
+
+#include <cstddef>
+#include <vector>
+
+namespace tjson {
+
+// The byte-scanning loops that dominate tokenizing and writing, each with a
+// portable implementation plus vectorized ones. The best set this CPU
+// supports is picked once, on first use, unless overridden by setting the
+// environment variable TJSON_KERNELS to one of the names in all_kernels().
+struct Kernels final
+{
+   const char* name;
+
+   // Returns the first char in [begin, end) that isn't JSON whitespace, or
+   // `end`.
+   const char* (*skip_whitespace)(const char* begin, const char* end);
+
+   // Returns the first '"' or '\\' in [begin, end), or `end`. This finds both
+   // the end of a string token and the chars escape() needs to escape.
+   const char* (*find_quote_or_backslash)(const char* begin, const char* end);
+
+   // Returns the first occurrence of [needle, needle + needle_size) in
+   // [begin, end), or `end`. `needle_size` must be nonzero.
+   const char* (*find_substring)(const char* begin, const char* end,
+                                 const char* needle, size_t needle_size);
+
+   // Whether [begin, end) is well-formed UTF-8.
+   bool (*validate_utf8)(const char* begin, const char* end);
+
+   // Whether this CPU can run this set.
+   bool (*is_supported)();
+};
+
+const Kernels& kernels();
+
+// Every set built into this binary, from most portable to fastest.
+const std::vector<const Kernels*>& all_kernels();
+
+} // namespace tjson
+
+#endif // TJSON_KERNELS_H
@@ -0,0 +1,331 @@
+#include "tjson_path.h"
+
+#include "tjson_fields.h"
+#include "tjson_kernels.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+namespace tjson {
+
+static bool
+is_name_char(const char c)
+{
+   return ('A' <= c && c <= 'Z') || ('a' <= c && c <= 'z') ||
+          ('0' <= c && c <= '9') || c == '_' || c == '-' || c == '$' ||
+          (c & 0x80);
+}
+
+/*static*/ bool
+Path::parse(const std::string& expr, Path* const out, std::string* const out_err)
+{
+   out->steps_.clear();
+   size_t i = 0;
+   const auto fn_fail = [&](const char* const expected) {
+      *out_err = "Error: Path col " + std::to_string(i + 1) + ": Expected " +
+                 expected + ", got: \"" + expr.substr(i, 20) + "\".";
+      return false;
+   };
+
+   if (expr == ".")
+      return true;
+   if (expr.empty())
+      return fn_fail("\".\" or \"[\"");
+
+   while (i < expr.size()) {
+      if (expr[i] == '.') {
+         i += 1;
+         if (i < expr.size() && expr[i] == '[')
+            continue;
+         const auto begin = i;
+         while (i < expr.size() && is_name_char(expr[i])) {
+            i += 1;
+         }
+         if (i == begin)
+            return fn_fail("a key name");
+         out->steps_.push_back({Step::Kind::KEY, expr.substr(begin, i - begin),
+                                0});
+      } else if (expr[i] == '[') {
+         i += 1;
+         if (i < expr.size() && expr[i] == ']') {
+            i += 1;
+            out->steps_.push_back({Step::Kind::EACH, "", 0});
+         } else if (i < expr.size() && expr[i] == '"') {
+            TokenGen tok_gen(expr.data() + i, expr.data() + expr.size());
+            const auto tok = tok_gen.Next();
+            std::string key;
+            if (tok.type != Token::Type::STRING ||
+                !unescape(tok.begin, tok.end, &key))
+            {
+               return fn_fail("a STRING");
+            }
+            i += size_t(tok.end - tok.begin);
+            if (i == expr.size() || expr[i] != ']')
+               return fn_fail("\"]\"");
+            i += 1;
+            out->steps_.push_back({Step::Kind::KEY, std::move(key), 0});
+         } else {
+            const auto begin = i;
+            size_t index = 0;
+            while (i < expr.size() && '0' <= expr[i] && expr[i] <= '9') {
+               const auto digit = size_t(expr[i] - '0');
+               if (index > (std::numeric_limits<size_t>::max() - digit) / 10) {
+                  i = begin;
+                  return fn_fail("an index that fits in size_t");
+               }
+               index = index * 10 + digit;
+               i += 1;
+            }
+            if (i == begin)
+               return fn_fail("an index, a STRING or \"]\"");
+            if (i == expr.size() || expr[i] != ']')
+               return fn_fail("\"]\"");
+            i += 1;
+            out->steps_.push_back({Step::Kind::INDEX, "", index});
+         }
+      } else {
+         return fn_fail("\".\" or \"[\"");
+      }
+   }
+   return true;
+}
+
+bool
+Path::matches(const size_t depth, const Token* const key,
+              const size_t index) const
+{
+   if (depth >= steps_.size())
+      return false;
+   const auto& step = steps_[depth];
+   switch (step.kind) {
+   case Step::Kind::EACH:
+      return true;
+   case Step::Kind::INDEX:
+      return !key && index == step.index;
+   case Step::Kind::KEY:
+      break;
+   }
+   if (!key)
+      return false;
+
+   const auto inner = key->begin + 1;
+   const auto inner_size = size_t(key->end - key->begin) - 2;
+   if (!memchr(inner, '\\', inner_size))
+      return inner_size == step.key.size() &&
+             !memcmp(inner, step.key.data(), inner_size);
+
+   std::string unescaped;
+   return unescape(key->begin, key->end, &unescaped) && unescaped == step.key;
+}
+
+// -
+
+namespace {
+
+// Records where the one value walked starts and ends.
+struct SpanHandler final
+{
+   Span span = {nullptr, nullptr};
+
+   bool OnOpen(const Token& tok) {
+      if (!span.begin) {
+         span.begin = tok.begin;
+      }
+      return true;
+   }
+   bool OnKey(const Token&) { return true; }
+   bool OnScalar(const Token& tok) {
+      if (!span.begin) {
+         span.begin = tok.begin;
+      }
+      span.end = tok.end;
+      return true;
+   }
+   bool OnClose(const Token& tok) {
+      span.end = tok.end;
+      return true;
+   }
+};
+
+// Past the dict or list at `open`, by matching brackets outside of strings,
+// without checking anything else. Returns nullptr if it doesn't close.
+const char*
+skip_container(const Token& open, const char* const end)
+{
+   const auto& k = kernels();
+   size_t depth = 0;
+   for (auto itr = open.begin; itr != end; ++itr) {
+      switch (*itr) {
+      case '"':
+         while (true) {
+            itr = k.find_quote_or_backslash(itr + 1, end);
+            if (itr == end)
+               return nullptr;
+            if (*itr == '"')
+               break;
+            itr += 1; // Past the escaped char.
+            if (itr == end)
+               return nullptr;
+         }
+         break;
+      case '{':
+      case '[':
+         depth += 1;
+         break;
+      case '}':
+      case ']':
+         depth -= 1;
+         if (!depth)
+            return itr + 1;
+         break;
+      }
+   }
+   return nullptr;
+}
+
+// Skips the value next in `*tokens`, only checking containers' brackets.
+bool
+skip_value_fast(TokenGen* const tokens, const char* const end,
+                std::string* const out_err)
+{
+   auto peek_gen = *tokens;
+   const auto open = peek_gen.NextNonWS();
+   if (!(open == "{" || open == "["))
+      return skip_value(tokens, out_err);
+
+   const auto after = skip_container(open, end);
+   if (!after) {
+      *out_err = open.expected_err("a closed container");
+      return false;
+   }
+   // Resume at `after`, keeping line numbers for errors.
+   auto pos = open;
+   pos.begin = after;
+   pos.end = end;
+   const auto lines = std::count(open.begin, after, '\n');
+   if (lines) {
+      pos.line_num += uint64_t(lines);
+      const auto line_begin = std::find(std::reverse_iterator<const char*>(after),
+                                        std::reverse_iterator<const char*>(open.begin),
+                                        '\n').base();
+      pos.line_pos = uint64_t(after - line_begin) + 1;
+   } else {
+      pos.line_pos += uint64_t(after - open.begin);
+   }
+   *tokens = TokenGen(pos);
+   return true;
+}
+
+} // namespace
+
+bool
+locate(const char* const begin, const char* const end, const Path& path,
+       Span* const out, std::string* const out_err)
+{
+   TokenGen tokens(begin, end);
+   const auto& steps = path.steps();
+   for (size_t depth = 0; depth < steps.size(); ++depth) {
+      const auto& step = steps[depth];
+      if (step.kind == Path::Step::Kind::EACH) {
+         *out_err = "Error: Path step " + std::to_string(depth + 1) +
+                    ": Expected a key or an index, got: \"[]\".";
+         return false;
+      }
+      const auto is_dict = (step.kind == Path::Step::Kind::KEY);
+      const auto close = is_dict ? "}" : "]";
+      const auto expected = is_dict ? "key " + escape(step.key)
+                                    : "item " + std::to_string(step.index);
+
+      const auto open = tokens.NextNonWS();
+      if (!(open == (is_dict ? "{" : "["))) {
+         *out_err = open.expected_err(is_dict ? "\"{\"" : "\"[\"");
+         return false;
+      }
+      auto peek_gen = tokens;
+      const auto peek = peek_gen.NextNonWS();
+      if (peek == close) {
+         *out_err = peek.expected_err(expected.c_str());
+         return false;
+      }
+
+      // Skip members up to the one on the path. As read() keeps the last of
+      // any repeated keys, a dict is scanned to its end, resuming at the
+      // last match.
+      size_t index = 0;
+      auto found = false;
+      auto found_at = tokens;
+      while (true) {
+         if (is_dict) {
+            const auto key = tokens.NextNonWS();
+            if (key.type != Token::Type::STRING) {
+               *out_err = key.expected_err("STRING");
+               return false;
+            }
+            const auto colon = tokens.NextNonWS();
+            if (!(colon == ":")) {
+               *out_err = colon.expected_err("\":\"");
+               return false;
+            }
+            if (path.matches(depth, &key, 0)) {
+               found = true;
+               found_at = tokens;
+            }
+         } else if (index == step.index) {
+            found = true;
+            found_at = tokens;
+            break;
+         }
+         if (!skip_value_fast(&tokens, end, out_err))
+            return false;
+         index += 1;
+
+         const auto tok = tokens.NextNonWS();
+         if (tok == close) {
+            if (found)
+               break;
+            *out_err = tok.expected_err(expected.c_str());
+            return false;
+         }
+         if (!(tok == ",")) {
+            *out_err = tok.expected_err("\",\"");
+            return false;
+         }
+      }
+      tokens = found_at;
+   }
+
+   SpanHandler handler;
+   if (!walk(&tokens, &handler, out_err))
+      return false;
+   *out = handler.span;
+   return true;
+}
+
+bool
+splice(std::string* const text, const Path& path,
+       const std::string& replacement, std::string* const out_err)
+{
+   const auto repl_end = replacement.data() + replacement.size();
+   TokenGen repl_tokens(replacement.data(), repl_end);
+   SpanHandler repl_handler;
+   if (!walk(&repl_tokens, &repl_handler, out_err))
+      return false;
+   const auto rest = repl_tokens.NextNonWS();
+   if (rest.begin != repl_end) {
+      *out_err = rest.expected_err("end of input");
+      return false;
+   }
+
+   Span span;
+   if (!locate(text->data(), text->data() + text->size(), path, &span,
+               out_err))
+   {
+      return false;
+   }
+   const auto offset = size_t(span.begin - text->data());
+   text->replace(offset, size_t(span.end - span.begin), replacement);
+   return true;
+}
+
+} // namespace tjson
@@ -0,0 +1,156 @@
+#ifndef TJSON_PATH_H
+#define TJSON_PATH_H
+
+#include "tjson_walk.h"
+
+namespace tjson {
+
+// A jq-style path to the values to select from a document: `.key` or
+// `["key"]` for a dict member, `[N]` for a list item, and `[]` for every item
+// or member value, chained like `.users[].name`. "." alone is the root.
+class Path final
+{
+public:
+   struct Step final
+   {
+      enum class Kind : uint8_t {
+         KEY,
+         INDEX,
+         EACH,
+      };
+
+      Kind kind;
+      std::string key; // Unescaped, for KEY.
+      size_t index;    // For INDEX.
+   };
+
+private:
+   std::vector<Step> steps_;
+
+public:
+   // Returns false and sets `*out_err` if `expr` doesn't parse.
+   static bool parse(const std::string& expr, Path* out, std::string* out_err);
+
+   const std::vector<Step>& steps() const { return steps_; }
+
+   // Whether the member named by `key` (a STRING token, for a dict) or at
+   // `index` (for a list) matches the step at `depth`.
+   bool matches(size_t depth, const Token* key, size_t index) const;
+};
+
+// Walks one value from `tokens` like walk(), checking all of it, but only
+// passes `handler` the tokens of values at `path`, each as a whole value.
+// Before each, it calls:
+//
+//    bool OnMatch(const Token& first);
+template<typename TokensT, typename HandlerT>
+bool
+select(TokensT* const tokens, const Path& path, HandlerT* const handler,
+       std::string* const out_err)
+{
+   static const size_t NONE = size_t(-1);
+
+   struct Frame final
+   {
+      bool is_dict;
+      bool on_path; // Whether every step down to here matched.
+      size_t count;
+      bool key_matches; // For dicts, whether the current key does.
+   };
+
+   class Filter final
+   {
+      const Path& path_;
+      HandlerT* const handler_;
+      std::vector<Frame> frames_;
+      size_t forward_depth_ = NONE; // Frames at the start of a selected value.
+
+   public:
+      Filter(const Path& path, HandlerT* const handler)
+         : path_(path)
+         , handler_(handler)
+      { }
+
+   private:
+      // Whether the value starting now is on the path, counting it in its
+      // parent.
+      bool begin_value() {
+         if (frames_.empty())
+            return true;
+         auto& top = frames_.back();
+         if (top.is_dict)
+            return top.on_path && top.key_matches;
+         top.count += 1;
+         return top.on_path &&
+                path_.matches(frames_.size() - 1, nullptr, top.count - 1);
+      }
+
+   public:
+      bool OnOpen(const Token& tok) {
+         if (forward_depth_ != NONE) {
+            frames_.push_back({*tok.begin == '{', false, 0, false});
+            return handler_->OnOpen(tok);
+         }
+         const auto on_path = begin_value();
+         if (on_path && frames_.size() == path_.steps().size()) {
+            forward_depth_ = frames_.size();
+            frames_.push_back({*tok.begin == '{', false, 0, false});
+            return handler_->OnMatch(tok) && handler_->OnOpen(tok);
+         }
+         frames_.push_back({*tok.begin == '{', on_path, 0, false});
+         return true;
+      }
+
+      bool OnKey(const Token& tok) {
+         if (forward_depth_ != NONE)
+            return handler_->OnKey(tok);
+         auto& top = frames_.back();
+         top.count += 1;
+         top.key_matches = top.on_path &&
+                           path_.matches(frames_.size() - 1, &tok, NONE);
+         return true;
+      }
+
+      bool OnScalar(const Token& tok) {
+         if (forward_depth_ != NONE)
+            return handler_->OnScalar(tok);
+         if (begin_value() && frames_.size() == path_.steps().size())
+            return handler_->OnMatch(tok) && handler_->OnScalar(tok);
+         return true;
+      }
+
+      bool OnClose(const Token& tok) {
+         frames_.pop_back();
+         if (forward_depth_ == NONE)
+            return true;
+         if (frames_.size() == forward_depth_) {
+            forward_depth_ = NONE;
+         }
+         return handler_->OnClose(tok);
+      }
+   } filter(path, handler);
+
+   return walk(tokens, &filter, out_err);
+}
+
+// -
+// Edits on raw text, for changing one value in a large document without
+// building a Val. `path` must name one value, so it can't have a `[]` step.
+
+// Finds the value at `path` in [begin, end). Dicts and lists off the path are
+// skipped by matching brackets, so only what's on the path and the value
+// itself are checked. Each dict on the path is scanned to its end, since like
+// read(), the last of any repeated keys matches; lists stop at the item.
+bool locate(const char* begin, const char* end, const Path& path, Span* out,
+            std::string* out_err);
+
+// Replaces the value at `path` in `*text` with `replacement`, which must be
+// one well-formed value. Only patches `*text` in place: The same length
+// overwrites just the value, and any other moves the text after it too,
+// reallocating `*text` if it grows past its capacity.
+bool splice(std::string* text, const Path& path, const std::string& replacement,
+            std::string* out_err);
+
+} // namespace tjson
+
+#endif // TJSON_PATH_H
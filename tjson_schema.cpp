@@ -0,0 +1,718 @@
+#include "tjson_schema.h"
+
+#include "tjson_walk.h"
+
+#include <cmath>
+#include <limits>
+#include <sstream>
+
+namespace tjson {
+
+// Keywords that only annotate, and so never affect validation.
+static const char* const ANNOTATIONS[] = {
+   "$schema", "$id", "$comment", "$anchor", "title", "description", "default",
+   "examples", "deprecated", "readOnly", "writeOnly", "format",
+};
+
+static bool
+is_annotation(const std::string& keyword)
+{
+   for (const auto& x : ANNOTATIONS) {
+      if (keyword == x)
+         return true;
+   }
+   return false;
+}
+
+// Appends `key` to a JSON Pointer, escaping '~' and '/'.
+static void
+append_pointer(std::string* const path, const std::string& key)
+{
+   *path += '/';
+   for (const auto c : key) {
+      if (c == '~') {
+         *path += "~0";
+      } else if (c == '/') {
+         *path += "~1";
+      } else {
+         *path += c;
+      }
+   }
+}
+
+// Number of code points in well-formed UTF-8.
+static size_t
+utf8_length(const std::string& s)
+{
+   size_t ret = 0;
+   for (const auto c : s) {
+      ret += ((uint8_t(c) & 0xc0) != 0x80);
+   }
+   return ret;
+}
+
+// -
+
+class Schema::Compiler final
+{
+   Schema* const schema_;
+   std::string* const out_err_;
+   std::unordered_map<std::string, size_t> def_nodes_;
+
+public:
+   Compiler(Schema* const schema, std::string* const out_err)
+      : schema_(schema)
+      , out_err_(out_err)
+   { }
+
+   bool fail(const std::string& path, const std::string& what) {
+      *out_err_ = "Error: Schema " + (path.size() ? path : std::string("/")) +
+                  ": " + what + ".";
+      return false;
+   }
+
+   size_t add_node() {
+      schema_->nodes_.emplace_back();
+      return schema_->nodes_.size() - 1;
+   }
+
+   bool compile_root(const Val& root) {
+      add_node(); // The `true` schema.
+      const auto root_i = add_node();
+
+      if (root.is_dict()) {
+         const auto& defs = root["$defs"];
+         if (!!defs) {
+            if (!defs.is_dict())
+               return fail("/$defs", "Expected a dict");
+            // Reserve a node per def first, so refs can point forward.
+            for (const auto& kv : defs.dict()) {
+               def_nodes_[kv.first] = add_node();
+            }
+            for (const auto& kv : defs.dict()) {
+               std::string path = "/$defs";
+               append_pointer(&path, kv.first);
+               if (!compile(*kv.second, def_nodes_[kv.first], path))
+                  return false;
+            }
+         }
+      }
+      if (!compile(root, root_i, ""))
+         return false;
+
+      // A cycle of bare refs would never reach a real node.
+      for (size_t i = 0; i < schema_->nodes_.size(); ++i) {
+         auto cur = i;
+         for (size_t hops = 0; schema_->nodes_[cur].ref != NONE; ++hops) {
+            if (hops == schema_->nodes_.size())
+               return fail("", "\"$ref\" cycle");
+            cur = schema_->nodes_[cur].ref;
+         }
+      }
+      return true;
+   }
+
+   bool compile_child(const Val& val, const std::string& path,
+                      size_t* const out_node)
+   {
+      *out_node = add_node();
+      return compile(val, *out_node, path);
+   }
+
+   bool get_count(const Val& val, const std::string& path,
+                  size_t* const out) {
+      double d;
+      if (!val.is_val() || !val.as_number(&d) || d < 0 || d != std::floor(d))
+         return fail(path, "Expected a non-negative integer");
+      // Converting a double beyond size_t's range is undefined, and any such
+      // bound is unreachable anyway.
+      const auto max = std::numeric_limits<size_t>::max();
+      *out = (d >= double(max)) ? max : size_t(d);
+      return true;
+   }
+
+   bool get_number(const Val& val, const std::string& path, double* const out) {
+      if (!val.is_val() || val.val()[0] == '"' || !val.as_number(out))
+         return fail(path, "Expected a number");
+      return true;
+   }
+
+   bool get_literal(const Val& val, const std::string& path,
+                    Literal* const out) {
+      if (!val.is_val())
+         return fail(path, "Only scalars are supported");
+      if (val.val()[0] == '"') {
+         out->type = Token::Type::STRING;
+         return val.as_string(&out->text) || fail(path, "Invalid string");
+      }
+      out->type = Token::Type::WORD;
+      out->text = val.val();
+      out->number = 0;
+      if (out->text != "true" && out->text != "false" && out->text != "null" &&
+          !val.as_number(&out->number))
+      {
+         return fail(path, "Invalid literal");
+      }
+      return true;
+   }
+
+   bool compile_type(const Val& val, const std::string& path,
+                     uint8_t* const out) {
+      std::string name;
+      if (!val.as_string(&name))
+         return fail(path, "Expected a type name");
+      if (name == "null") {
+         *out |= NULL_TYPE;
+      } else if (name == "boolean") {
+         *out |= BOOLEAN;
+      } else if (name == "integer") {
+         *out |= INTEGER;
+      } else if (name == "number") {
+         *out |= NUMBER | INTEGER;
+      } else if (name == "string") {
+         *out |= STRING;
+      } else if (name == "array") {
+         *out |= ARRAY;
+      } else if (name == "object") {
+         *out |= OBJECT;
+      } else {
+         return fail(path, "Unknown type \"" + name + "\"");
+      }
+      return true;
+   }
+
+   // Compiles into nodes_[node_i]. `nodes_` may grow, so index it afresh after
+   // compiling any child.
+   bool compile(const Val& val, const size_t node_i, const std::string& path) {
+      const auto fn_node = [&]() -> Node& { return schema_->nodes_[node_i]; };
+
+      if (val.is_val()) {
+         if (val.val() == "true")
+            return true;
+         if (val.val() == "false") {
+            fn_node().reject_all = true;
+            return true;
+         }
+      }
+      if (!val.is_dict())
+         return fail(path, "Expected a dict or boolean");
+
+      for (const auto& kv : val.dict()) {
+         const auto& keyword = kv.first;
+         const auto& v = *kv.second;
+         auto sub_path = path;
+         append_pointer(&sub_path, keyword);
+
+         if (keyword == "type") {
+            fn_node().types = 0;
+            if (v.is_list()) {
+               for (const auto& x : v.list()) {
+                  if (!compile_type(*x, sub_path, &fn_node().types))
+                     return false;
+               }
+            } else if (!compile_type(v, sub_path, &fn_node().types)) {
+               return false;
+            }
+         } else if (keyword == "enum" || keyword == "const") {
+            std::vector<const Val*> items;
+            if (keyword == "const") {
+               items.push_back(&v);
+            } else if (v.is_list()) {
+               for (const auto& x : v.list()) {
+                  items.push_back(x.get());
+               }
+            } else {
+               return fail(sub_path, "Expected a list");
+            }
+            if (fn_node().has_literals)
+               return fail(sub_path, "\"enum\" with \"const\" is unsupported");
+            fn_node().has_literals = true;
+            for (const auto x : items) {
+               Literal lit;
+               if (!get_literal(*x, sub_path, &lit))
+                  return false;
+               fn_node().literals.push_back(std::move(lit));
+            }
+         } else if (keyword == "properties") {
+            if (!v.is_dict())
+               return fail(sub_path, "Expected a dict");
+            for (const auto& prop : v.dict()) {
+               auto prop_path = sub_path;
+               append_pointer(&prop_path, prop.first);
+               size_t child;
+               if (!compile_child(*prop.second, prop_path, &child))
+                  return false;
+               auto& node = fn_node();
+               const auto res = node.property_index.insert(
+                  {prop.first, node.properties.size()});
+               if (res.second) {
+                  node.properties.push_back(child);
+               } else {
+                  node.properties[res.first->second] = child;
+               }
+            }
+         } else if (keyword == "additionalProperties") {
+            size_t child;
+            if (!compile_child(v, sub_path, &child))
+               return false;
+            fn_node().additional_properties = child;
+         } else if (keyword == "items") {
+            size_t child;
+            if (!compile_child(v, sub_path, &child))
+               return false;
+            fn_node().items = child;
+         } else if (keyword == "minItems") {
+            if (!get_count(v, sub_path, &fn_node().min_items))
+               return false;
+         } else if (keyword == "maxItems") {
+            if (!get_count(v, sub_path, &fn_node().max_items))
+               return false;
+         } else if (keyword == "minLength") {
+            if (!get_count(v, sub_path, &fn_node().min_length))
+               return false;
+         } else if (keyword == "maxLength") {
+            if (!get_count(v, sub_path, &fn_node().max_length))
+               return false;
+         } else if (keyword == "minimum") {
+            if (!get_number(v, sub_path, &fn_node().minimum))
+               return false;
+            fn_node().has_minimum = true;
+         } else if (keyword == "exclusiveMinimum") {
+            if (!get_number(v, sub_path, &fn_node().exclusive_minimum))
+               return false;
+            fn_node().has_exclusive_minimum = true;
+         } else if (keyword == "maximum") {
+            if (!get_number(v, sub_path, &fn_node().maximum))
+               return false;
+            fn_node().has_maximum = true;
+         } else if (keyword == "exclusiveMaximum") {
+            if (!get_number(v, sub_path, &fn_node().exclusive_maximum))
+               return false;
+            fn_node().has_exclusive_maximum = true;
+         } else if (keyword == "$ref") {
+            std::string ref;
+            if (!v.as_string(&ref))
+               return fail(sub_path, "Expected a string");
+            const std::string DEFS_PREFIX = "#/$defs/";
+            if (ref == "#") {
+               fn_node().ref = ROOT;
+            } else if (!ref.compare(0, DEFS_PREFIX.size(), DEFS_PREFIX) &&
+                       def_nodes_.count(ref.substr(DEFS_PREFIX.size())))
+            {
+               fn_node().ref = def_nodes_[ref.substr(DEFS_PREFIX.size())];
+            } else {
+               return fail(sub_path, "Unresolvable \"" + ref + "\"");
+            }
+         } else if (keyword == "required") {
+            // Handled below, once "properties" are indexed.
+         } else if (keyword == "$defs") {
+            if (path.size())
+               return fail(sub_path, "Only supported at the root");
+         } else if (!is_annotation(keyword)) {
+            return fail(sub_path, "Unsupported keyword");
+         }
+      }
+
+      const auto& required = val["required"];
+      if (!!required) {
+         if (!required.is_list())
+            return fail(path + "/required", "Expected a list");
+         for (const auto& x : required.list()) {
+            std::string key;
+            if (!x->as_string(&key))
+               return fail(path + "/required", "Expected strings");
+            auto& node = fn_node();
+            const auto res = node.property_index.insert(
+               {key, node.properties.size()});
+            if (res.second) {
+               // Required but otherwise unconstrained.
+               node.properties.push_back(0);
+            }
+            node.required.push_back(res.first->second);
+         }
+      }
+
+      if (fn_node().ref != NONE && val.dict().size() > 1) {
+         // Other keywords alongside "$ref" would need both to apply.
+         for (const auto& kv : val.dict()) {
+            if (kv.first != "$ref" && kv.first != "$defs" &&
+                !is_annotation(kv.first))
+            {
+               return fail(path, "\"$ref\" with siblings is unsupported");
+            }
+         }
+      }
+      return true;
+   }
+};
+
+/*static*/ std::unique_ptr<Schema>
+Schema::compile(const Val& schema, std::string* const out_err)
+{
+   std::unique_ptr<Schema> ret(new Schema);
+   Compiler compiler(ret.get(), out_err);
+   if (!compiler.compile_root(schema))
+      return nullptr;
+   return ret;
+}
+
+const Schema::Node&
+Schema::node(size_t i) const
+{
+   while (nodes_[i].ref != NONE) {
+      i = nodes_[i].ref;
+   }
+   return nodes_[i];
+}
+
+// -
+
+namespace {
+
+// A walk() handler that checks each value against its subschema as it
+// arrives.
+class Checker final
+{
+   struct Frame final
+   {
+      const Schema::Node* node;
+      bool is_dict;
+      size_t count;
+      std::vector<bool> seen; // Per property, for "required".
+      std::string key;
+      size_t value_node; // For the value after `key`.
+   };
+
+   const Schema& schema_;
+   std::string* const out_err_;
+   std::vector<Frame> frames_; // Only [0, depth_) are live, to reuse buffers.
+   size_t depth_ = 0;
+   std::string scratch_;
+
+public:
+   Checker(const Schema& schema, std::string* const out_err)
+      : schema_(schema)
+      , out_err_(out_err)
+   { }
+
+private:
+   // JSON Pointer to the value being checked, through `depth` frames.
+   std::string path(const size_t depth) const {
+      std::string ret;
+      for (size_t i = 0; i < depth; ++i) {
+         const auto& f = frames_[i];
+         if (f.is_dict) {
+            append_pointer(&ret, f.key);
+         } else {
+            ret += '/';
+            ret += std::to_string(f.count - 1);
+         }
+      }
+      return ret;
+   }
+
+   bool fail(const Token& tok, const size_t depth, const std::string& what) {
+      auto got = tok.str();
+      if (got.length() > 20) {
+         got.resize(20);
+      }
+      std::ostringstream err;
+      err << "Error: L" << tok.line_num << ":" << tok.line_pos << ": "
+          << (depth ? path(depth) : "/") << ": " << what << ", got: \"" << got
+          << "\".";
+      *out_err_ = err.str();
+      return false;
+   }
+
+   // Subschema for the value starting now, counting it in its parent.
+   const Schema::Node& value_node() {
+      if (!depth_)
+         return schema_.node(Schema::ROOT);
+      auto& top = frames_[depth_ - 1];
+      if (top.is_dict)
+         return schema_.node(top.value_node);
+      top.count += 1;
+      return schema_.node(top.node->items == Schema::NONE ? 0 : top.node->items);
+   }
+
+   bool check_type(const Token& tok, const Schema::Node& node,
+                   const uint8_t type) {
+      if (node.reject_all)
+         return fail(tok, depth_, "Expected no value");
+      if (!(node.types & type)) {
+         static const char* const NAMES[] = {
+            "null", "boolean", "integer", "number", "string", "array", "object",
+         };
+         std::string expected;
+         for (size_t i = 0; i < 7; ++i) {
+            if ((node.types >> i) & 1) {
+               if ((1 << i) == Schema::INTEGER && (node.types & Schema::NUMBER))
+                  continue;
+               expected += (expected.size() ? " or \"" : "type \"");
+               expected += NAMES[i];
+               expected += '"';
+            }
+         }
+         return fail(tok, depth_, "Expected " + expected);
+      }
+      return true;
+   }
+
+public:
+   bool OnOpen(const Token& tok) {
+      const auto& node = value_node();
+      const bool is_dict = (*tok.begin == '{');
+      if (!check_type(tok, node, is_dict ? Schema::OBJECT : Schema::ARRAY))
+         return false;
+      if (node.has_literals)
+         return fail(tok, depth_, "Expected one of \"enum\"");
+
+      if (depth_ == frames_.size()) {
+         frames_.emplace_back();
+      }
+      auto& f = frames_[depth_];
+      depth_ += 1;
+      f.node = &node;
+      f.is_dict = is_dict;
+      f.count = 0;
+      f.seen.assign(node.properties.size(), false);
+      return true;
+   }
+
+   bool OnKey(const Token& tok) {
+      auto& f = frames_[depth_ - 1];
+      f.count += 1;
+      if (!unescape(tok.begin, tok.end, &f.key))
+         return fail(tok, depth_ - 1, "Expected a valid key");
+
+      const auto itr = f.node->property_index.find(f.key);
+      if (itr != f.node->property_index.end()) {
+         f.seen[itr->second] = true;
+         f.value_node = f.node->properties[itr->second];
+         return true;
+      }
+      f.value_node = (f.node->additional_properties == Schema::NONE
+                      ? 0 : f.node->additional_properties);
+      if (schema_.node(f.value_node).reject_all)
+         return fail(tok, depth_, "Expected no key");
+      return true;
+   }
+
+   bool OnScalar(const Token& tok) {
+      const auto& node = value_node();
+
+      double number = 0;
+      uint8_t type;
+      if (tok.type == Token::Type::STRING) {
+         type = Schema::STRING;
+      } else if (tok == "true" || tok == "false") {
+         type = Schema::BOOLEAN;
+      } else if (tok == "null") {
+         type = Schema::NULL_TYPE;
+      } else {
+         if (!parse_number(tok.begin, tok.end, &number))
+            return fail(tok, depth_, "Expected a number");
+         type = (std::isfinite(number) && number == std::floor(number)
+                 ? Schema::INTEGER : Schema::NUMBER);
+      }
+      if (!check_type(tok, node, type))
+         return false;
+
+      const bool needs_text = (type == Schema::STRING &&
+                               (node.has_literals || node.min_length ||
+                                node.max_length != Schema::NONE));
+      if (needs_text && !unescape(tok.begin, tok.end, &scratch_))
+         return fail(tok, depth_, "Expected a valid string");
+
+      if (type == Schema::STRING &&
+          (node.min_length || node.max_length != Schema::NONE))
+      {
+         const auto len = utf8_length(scratch_);
+         if (len < node.min_length)
+            return fail(tok, depth_, "Expected \"minLength\" " +
+                                     std::to_string(node.min_length));
+         if (len > node.max_length)
+            return fail(tok, depth_, "Expected \"maxLength\" " +
+                                     std::to_string(node.max_length));
+      }
+
+      if (type & (Schema::INTEGER | Schema::NUMBER)) {
+         if (node.has_minimum && number < node.minimum)
+            return fail(tok, depth_, "Expected at least \"minimum\"");
+         if (node.has_exclusive_minimum && number <= node.exclusive_minimum)
+            return fail(tok, depth_, "Expected above \"exclusiveMinimum\"");
+         if (node.has_maximum && number > node.maximum)
+            return fail(tok, depth_, "Expected at most \"maximum\"");
+         if (node.has_exclusive_maximum && number >= node.exclusive_maximum)
+            return fail(tok, depth_, "Expected below \"exclusiveMaximum\"");
+      }
+
+      if (node.has_literals) {
+         bool found = false;
+         for (const auto& lit : node.literals) {
+            if (type == Schema::STRING) {
+               found = (lit.type == Token::Type::STRING && lit.text == scratch_);
+            } else if (type & (Schema::INTEGER | Schema::NUMBER)) {
+               found = (lit.type == Token::Type::WORD && lit.number == number &&
+                        lit.text != "true" && lit.text != "false" &&
+                        lit.text != "null");
+            } else {
+               found = (lit.type == Token::Type::WORD &&
+                        tok == lit.text.c_str());
+            }
+            if (found)
+               break;
+         }
+         if (!found)
+            return fail(tok, depth_, "Expected one of \"enum\"");
+      }
+      return true;
+   }
+
+   bool OnClose(const Token& tok) {
+      const auto& f = frames_[depth_ - 1];
+      const auto& node = *f.node;
+      // Errors here are about the container, so point at it.
+      const auto depth = depth_ - 1;
+      if (f.is_dict) {
+         for (const auto prop : node.required) {
+            if (!f.seen[prop]) {
+               std::string key;
+               for (const auto& kv : node.property_index) {
+                  if (kv.second == prop) {
+                     key = kv.first;
+                  }
+               }
+               return fail(tok, depth, "Expected required key \"" + key + "\"");
+            }
+         }
+      } else {
+         if (f.count < node.min_items)
+            return fail(tok, depth, "Expected \"minItems\" " +
+                                    std::to_string(node.min_items));
+         if (f.count > node.max_items)
+            return fail(tok, depth, "Expected \"maxItems\" " +
+                                    std::to_string(node.max_items));
+      }
+      depth_ -= 1;
+      return true;
+   }
+};
+
+// A walk() handler that builds the Val that read() would, passing each token
+// to a Checker first.
+class CheckingBuilder final
+{
+   Checker* const checker_;
+   std::unique_ptr<Val> root_;
+   std::vector<Val*> stack_; // Open containers.
+   std::string key_;
+
+public:
+   explicit CheckingBuilder(Checker* const checker)
+      : checker_(checker)
+   { }
+
+   std::unique_ptr<Val> take() { return std::move(root_); }
+
+private:
+   // The Val for the value starting now, added to its parent.
+   Val* next() {
+      if (stack_.empty()) {
+         root_.reset(new Val);
+         return root_.get();
+      }
+      auto& top = *stack_.back();
+      if (top.is_dict())
+         return top[key_].get(); // Overwrites, like read().
+      return top[top.list().size()].get();
+   }
+
+public:
+   bool OnOpen(const Token& tok) {
+      if (!checker_->OnOpen(tok))
+         return false;
+      const auto val = next();
+      if (*tok.begin == '{') {
+         val->set_dict();
+      } else {
+         val->set_list();
+      }
+      stack_.push_back(val);
+      return true;
+   }
+
+   bool OnKey(const Token& tok) {
+      if (!checker_->OnKey(tok))
+         return false;
+      if (!unescape(tok.begin, tok.end, &key_)) {
+         key_.clear();
+      }
+      return true;
+   }
+
+   bool OnScalar(const Token& tok) {
+      if (!checker_->OnScalar(tok))
+         return false;
+      next()->set_val(std::string(tok.begin, tok.end));
+      return true;
+   }
+
+   bool OnClose(const Token& tok) {
+      if (!checker_->OnClose(tok))
+         return false;
+      stack_.pop_back();
+      return true;
+   }
+};
+
+} // namespace
+
+template<typename TokensT>
+static bool
+validate_impl(const Schema& schema, TokensT* const tokens,
+              std::string* const out_err)
+{
+   Checker checker(schema, out_err);
+   return walk(tokens, &checker, out_err);
+}
+
+bool
+Schema::validate(TokenGen* const tokens, std::string* const out_err) const
+{
+   return validate_impl(*this, tokens, out_err);
+}
+
+bool
+Schema::validate(TokenStream* const tokens, std::string* const out_err) const
+{
+   return validate_impl(*this, tokens, out_err);
+}
+
+bool
+Schema::validate(const char* const begin, const char* const end,
+                 std::string* const out_err) const
+{
+   TokenGen tok_gen(begin, end);
+   return validate(&tok_gen, out_err);
+}
+
+std::unique_ptr<Val>
+Schema::read(TokenGen* const tokens, std::string* const out_err) const
+{
+   Checker checker(*this, out_err);
+   CheckingBuilder builder(&checker);
+   if (!walk(tokens, &builder, out_err))
+      return nullptr;
+   return builder.take();
+}
+
+std::unique_ptr<Val>
+Schema::read(const char* const begin, const char* const end,
+             std::string* const out_err) const
+{
+   TokenGen tok_gen(begin, end);
+   return read(&tok_gen, out_err);
+}
+
+} // namespace tjson
@@ -0,0 +1,108 @@
+#ifndef TJSON_SCHEMA_H
+#define TJSON_SCHEMA_H
+
+#include "tjson.h"
+
+namespace tjson {
+
+// A JSON Schema compiled for checking documents as they're tokenized, in the
+// same pass as walk(), without building a Val.
+//
+// Supports this subset of draft 2020-12: boolean schemas, "type", "enum",
+// "const", "properties", "required", "additionalProperties", "items",
+// "minItems", "maxItems", "minLength", "maxLength", "minimum", "maximum",
+// "exclusiveMinimum", "exclusiveMaximum", and "$ref" to "#" or
+// "#/$defs/NAME". Annotations like "title" are ignored. Any other keyword
+// fails compile(), rather than silently passing everything.
+class Schema final
+{
+public:
+   enum TypeBits : uint8_t {
+      NULL_TYPE = 1 << 0,
+      BOOLEAN = 1 << 1,
+      INTEGER = 1 << 2,
+      NUMBER = 1 << 3, // Schema "number" sets INTEGER too.
+      STRING = 1 << 4,
+      ARRAY = 1 << 5,
+      OBJECT = 1 << 6,
+      ANY_TYPE = 0x7f,
+   };
+
+   static const size_t NONE = size_t(-1);
+
+   // A scalar from "enum" or "const". Strings are unescaped.
+   struct Literal final
+   {
+      Token::Type type;
+      std::string text;
+      double number;
+   };
+
+   // Subschemas refer to each other by index into nodes_.
+   struct Node final
+   {
+      size_t ref = NONE; // If set, this node is just "$ref".
+      bool reject_all = false;
+      uint8_t types = ANY_TYPE;
+
+      std::unordered_map<std::string, size_t> property_index;
+      std::vector<size_t> properties; // Node per property, in index order.
+      std::vector<size_t> required;   // Property indices.
+      size_t additional_properties = NONE; // NONE allows anything.
+      size_t items = NONE;
+
+      size_t min_items = 0;
+      size_t max_items = NONE;
+      size_t min_length = 0;
+      size_t max_length = NONE;
+
+      bool has_minimum = false;
+      bool has_maximum = false;
+      bool has_exclusive_minimum = false;
+      bool has_exclusive_maximum = false;
+      double minimum = 0;
+      double maximum = 0;
+      double exclusive_minimum = 0;
+      double exclusive_maximum = 0;
+
+      bool has_literals = false;
+      std::vector<Literal> literals;
+   };
+
+private:
+   std::vector<Node> nodes_;
+
+   Schema() = default;
+
+public:
+   // Returns nullptr and sets `*out_err` if `schema` isn't a valid schema
+   // within the supported subset.
+   static std::unique_ptr<Schema> compile(const Val& schema,
+                                          std::string* out_err);
+
+   // Validates one value from `tokens`. Errors are formatted as read()'s are,
+   // with the JSON Pointer of the offending value, like
+   // "Error: L3:12: /address/zip: Expected type "string", got: "10021".".
+   bool validate(TokenGen* tokens, std::string* out_err) const;
+   bool validate(TokenStream* tokens, std::string* out_err) const;
+   bool validate(const char* begin, const char* end, std::string* out_err) const;
+
+   // Reads one value from `tokens` like read(), validating it in the same
+   // pass, so a document is only tokenized once. Returns nullptr and sets
+   // `*out_err` as validate() does if it doesn't validate.
+   std::unique_ptr<Val> read(TokenGen* tokens, std::string* out_err) const;
+   std::unique_ptr<Val> read(const char* begin, const char* end,
+                             std::string* out_err) const;
+
+   static const size_t ROOT = 1; // Node 0 is the `true` schema.
+
+   // Node `i`, after following any "$ref"s.
+   const Node& node(size_t i) const;
+
+private:
+   class Compiler;
+};
+
+} // namespace tjson
+
+#endif // TJSON_SCHEMA_H
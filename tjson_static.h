@@ -0,0 +1,302 @@
+#ifndef TJSON_STATIC_H
+#define TJSON_STATIC_H
+
+#include "tjson_tape.h"
+
+namespace tjson {
+
+// A tape built at compile time from a string literal, with the literal itself
+// as its string buffer, so embedded documents cost no startup parsing and no
+// heap. Make one with TJSON_STATIC_TAPE:
+//
+//    static constexpr auto DEFAULTS = TJSON_STATIC_TAPE(R"({"retries": 3})");
+//    DEFAULTS.root()["retries"].as_number(&retries);
+//
+// Malformed JSON fails to compile, in a call to one of the functions in
+// static_json_error, whose name says what went wrong. Containers get no index
+// (see tape::INDEX), so lookups scan, which suits small embedded documents.
+template<size_t N>
+struct StaticTape final
+{
+   uint64_t words[N];
+   const char* strings;
+
+   TapeElem root() const { return TapeElem(words, strings, 0); }
+};
+
+// Deliberately not constexpr: reaching one during constant evaluation is the
+// compile error. Each takes the offending offset into the literal.
+namespace static_json_error {
+void expected_value(size_t offset);
+void expected_string_key(size_t offset);
+void expected_colon(size_t offset);
+void expected_comma_or_close(size_t offset);
+void malformed_number(size_t offset);
+void unterminated_string(size_t offset);
+void trailing_chars(size_t offset);
+void nested_too_deep(size_t offset);
+} // namespace static_json_error
+
+namespace static_json {
+
+const size_t MAX_DEPTH = 64;
+
+constexpr bool
+is_whitespace(const char c)
+{
+   return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+constexpr bool
+is_word_char(const char c)
+{
+   return ('A' <= c && c <= 'Z') || ('a' <= c && c <= 'z') ||
+          ('0' <= c && c <= '9') || c == '_' || c == '+' || c == '-' ||
+          c == '.';
+}
+
+constexpr bool
+is_digit(const char c)
+{
+   return '0' <= c && c <= '9';
+}
+
+// The same grammar parse_number() accepts: JSON's, plus a leading '+'.
+constexpr bool
+is_number(const char* const text, size_t i, const size_t end)
+{
+   if (i != end && (text[i] == '-' || text[i] == '+')) {
+      ++i;
+   }
+   if (i == end || !is_digit(text[i]))
+      return false;
+   if (text[i] == '0') {
+      ++i;
+   } else {
+      while (i != end && is_digit(text[i])) {
+         ++i;
+      }
+   }
+   if (i != end && text[i] == '.') {
+      const auto frac = ++i;
+      while (i != end && is_digit(text[i])) {
+         ++i;
+      }
+      if (i == frac)
+         return false;
+   }
+   if (i != end && (text[i] == 'e' || text[i] == 'E')) {
+      ++i;
+      if (i != end && (text[i] == '-' || text[i] == '+')) {
+         ++i;
+      }
+      const auto exp = i;
+      while (i != end && is_digit(text[i])) {
+         ++i;
+      }
+      if (i == exp)
+         return false;
+   }
+   return i == end;
+}
+
+// Parses `text` into `out` if it's non-null, counting how many words the tape
+// needs either way, so one pass can size the next. A class rather than
+// lambdas, since closures aren't literal types until C++17.
+class Parser final
+{
+   struct Frame final
+   {
+      size_t open = 0;
+      uint64_t count = 0;
+      bool is_dict = false;
+   };
+
+   const char* const text_;
+   const size_t size_;
+   uint64_t* const out_;
+
+   Frame stack_[MAX_DEPTH] = {};
+   size_t depth_ = 0;
+   size_t word_count_ = 0;
+   size_t i_ = 0;
+
+   // The current token is [tok_begin_, i_). Symbols are themselves, strings
+   // and words are '"' and 'a', and the end of input is 0.
+   size_t tok_begin_ = 0;
+   char tok_ = 0;
+
+public:
+   constexpr Parser(const char* const text, const size_t size,
+                    uint64_t* const out)
+      : text_(text)
+      , size_(size)
+      , out_(out)
+   { }
+
+private:
+   constexpr void next() {
+      while (i_ != size_ && is_whitespace(text_[i_])) {
+         ++i_;
+      }
+      tok_begin_ = i_;
+      if (i_ == size_) {
+         tok_ = 0;
+         return;
+      }
+      const auto c = text_[i_++];
+      if (c == '"') {
+         while (true) {
+            if (i_ == size_)
+               static_json_error::unterminated_string(tok_begin_);
+            if (text_[i_] == '"')
+               break;
+            if (text_[i_] == '\\') {
+               ++i_;
+               if (i_ == size_ || text_[i_] == '\n' || text_[i_] == '\r')
+                  static_json_error::unterminated_string(tok_begin_);
+            }
+            ++i_;
+         }
+         ++i_;
+         tok_ = '"';
+      } else if (is_word_char(c)) {
+         while (i_ != size_ && is_word_char(text_[i_])) {
+            ++i_;
+         }
+         if ((c == '-' || c == '+' || is_digit(c)) &&
+             !is_number(text_, tok_begin_, i_))
+         {
+            static_json_error::malformed_number(tok_begin_);
+         }
+         tok_ = 'a';
+      } else {
+         tok_ = c;
+      }
+   }
+
+   constexpr void emit(const uint64_t word) {
+      if (out_) {
+         out_[word_count_] = word;
+      }
+      ++word_count_;
+   }
+
+   constexpr void emit_scalar() {
+      emit(tape::make_word(tok_ == '"' ? tape::STRING : tape::WORD,
+                           tok_begin_));
+      emit(i_ - tok_begin_);
+   }
+
+   // Reads `"key":`, leaving the token after it current.
+   constexpr void key() {
+      if (tok_ != '"')
+         static_json_error::expected_string_key(tok_begin_);
+      emit_scalar();
+      next();
+      if (tok_ != ':')
+         static_json_error::expected_colon(tok_begin_);
+      next();
+   }
+
+   constexpr void close() {
+      depth_ -= 1;
+      const auto& f = stack_[depth_];
+      emit(tape::make_word(f.is_dict ? tape::DICT_END : tape::LIST_END,
+                           f.count));
+      if (out_) {
+         out_[f.open] = tape::make_word(f.is_dict ? tape::DICT : tape::LIST,
+                                        word_count_);
+      }
+   }
+
+public:
+   // Returns the word count.
+   constexpr size_t run() {
+      next();
+      while (true) {
+         // Here, the current token must start a value.
+         if (depth_) {
+            stack_[depth_ - 1].count += 1;
+         }
+         if (tok_ == '{' || tok_ == '[') {
+            if (depth_ == MAX_DEPTH)
+               static_json_error::nested_too_deep(tok_begin_);
+            const bool is_dict = (tok_ == '{');
+            auto& f = stack_[depth_];
+            f.open = word_count_;
+            f.count = 0;
+            f.is_dict = is_dict;
+            depth_ += 1;
+            emit(0); // Patched by close().
+
+            next();
+            if (tok_ == (is_dict ? '}' : ']')) {
+               close();
+            } else {
+               if (is_dict) {
+                  key();
+               }
+               continue;
+            }
+         } else if (tok_ == '"' || tok_ == 'a') {
+            emit_scalar();
+         } else {
+            static_json_error::expected_value(tok_begin_);
+         }
+
+         // After a value, close any containers that end here.
+         while (true) {
+            if (!depth_) {
+               emit(tape::make_word(tape::END, 0));
+               next();
+               if (tok_)
+                  static_json_error::trailing_chars(tok_begin_);
+               return word_count_;
+            }
+            const auto is_dict = stack_[depth_ - 1].is_dict;
+            next();
+            if (tok_ == (is_dict ? '}' : ']')) {
+               close();
+               continue;
+            }
+            if (tok_ != ',')
+               static_json_error::expected_comma_or_close(tok_begin_);
+            next();
+            if (is_dict) {
+               key();
+            }
+            break;
+         }
+      }
+   }
+};
+
+constexpr size_t
+count_words(const char* const text, const size_t size)
+{
+   return Parser(text, size, nullptr).run();
+}
+
+template<size_t N>
+constexpr StaticTape<N>
+make_tape(const char* const text, const size_t size)
+{
+   StaticTape<N> ret = {};
+   Parser(text, size, ret.words).run();
+   ret.strings = text;
+   return ret;
+}
+
+} // namespace static_json
+
+// `literal` must be a string literal, since it's used both to size and to
+// fill the tape.
+#define TJSON_STATIC_TAPE(literal) \
+   ::tjson::static_json::make_tape< \
+      ::tjson::static_json::count_words(literal, sizeof(literal) - 1)>( \
+         literal, sizeof(literal) - 1)
+
+} // namespace tjson
+
+#endif // TJSON_STATIC_H
@@ -0,0 +1,553 @@
+#include "tjson_tape.h"
+
+#include "tjson_fields.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ostream>
+
+namespace tjson {
+
+/*static*/ const TapeElem TapeElem::INVALID;
+
+// -
+
+static bool
+raw_key_equals(const char* const begin, const char* const end,
+               const std::string& key)
+{
+   const auto inner = begin + 1;
+   const auto inner_size = size_t(end - begin) - 2;
+   if (!memchr(inner, '\\', inner_size))
+      return inner_size == key.size() && !memcmp(inner, key.data(), inner_size);
+
+   std::string unescaped;
+   if (!unescape(begin, end, &unescaped))
+      return false;
+   return unescaped == key;
+}
+
+// The hash a dict index files a key under, of the key's bytes without quotes.
+static uint64_t
+index_hash(const char* const begin, const char* const end)
+{
+   return hash_key(begin, end, 0) >> tape::INDEX_POS_BITS;
+}
+
+// -
+
+size_t
+TapeElem::size() const
+{
+   if (!is_dict() && !is_list())
+      return 0;
+   return size_t(tape::word_payload(words_[payload() - 1]));
+}
+
+TapeElem
+TapeElem::first() const
+{
+   if (!is_dict() && !is_list())
+      return INVALID;
+   return TapeElem(words_, strings_, i_ + 1).next_or_self();
+}
+
+TapeElem
+TapeElem::next() const
+{
+   if (!words_)
+      return INVALID;
+
+   uint64_t next_i;
+   switch (type()) {
+   case tape::DICT:
+   case tape::LIST:
+      next_i = payload();
+      break;
+   default:
+      next_i = i_ + 2;
+      break;
+   }
+   return TapeElem(words_, strings_, next_i).next_or_self();
+}
+
+TapeElem
+TapeElem::next_or_self() const
+{
+   switch (type()) {
+   case tape::DICT_END:
+   case tape::LIST_END:
+   case tape::INDEX:
+   case tape::END:
+      return INVALID;
+   }
+   return *this;
+}
+
+const uint64_t*
+TapeElem::member_index() const
+{
+   const auto count = size();
+   if (count < tape::INDEX_MIN_SIZE)
+      return nullptr;
+   // Members take at least two words each, so this is past the open word.
+   const auto entries = payload() - 1 - count;
+   if (tape::word_type(words_[entries - 1]) != tape::INDEX)
+      return nullptr;
+   return words_ + entries;
+}
+
+TapeElem
+TapeElem::operator[](const std::string& x) const
+{
+   if (!is_dict())
+      return INVALID;
+
+   const auto entries = member_index();
+   if (!entries) {
+      auto ret = INVALID;
+      for (auto k = first(); !!k; k = k.next().next()) {
+         if (raw_key_equals(k.raw_begin(), k.raw_end(), x)) {
+            ret = k.next();
+         }
+      }
+      return ret;
+   }
+
+   // Every key with this hash, and every key with escapes, is a candidate.
+   // Each run is in position order.
+   const auto entries_end = entries + size();
+   uint64_t found = 0; // The root, so never a key.
+   const auto fn_scan = [&](const uint64_t* itr, const uint64_t hash) {
+      for (; itr != entries_end && (*itr >> tape::INDEX_POS_BITS) == hash;
+           ++itr)
+      {
+         const auto k = *itr & tape::INDEX_POS_MASK;
+         const auto begin = strings_ + tape::word_payload(words_[k]);
+         if (raw_key_equals(begin, begin + words_[k + 1], x)) {
+            found = std::max(found, k);
+         }
+      }
+   };
+   const auto hash = index_hash(x.data(), x.data() + x.size());
+   fn_scan(std::lower_bound(entries, entries_end,
+                            hash << tape::INDEX_POS_BITS),
+           hash);
+   if (hash != tape::ESCAPED_KEY_HASH) {
+      auto escaped = entries_end;
+      while (escaped != entries &&
+             (escaped[-1] >> tape::INDEX_POS_BITS) == tape::ESCAPED_KEY_HASH)
+      {
+         --escaped;
+      }
+      fn_scan(escaped, tape::ESCAPED_KEY_HASH);
+   }
+   if (!found)
+      return INVALID;
+   return TapeElem(words_, strings_, found + 2);
+}
+
+TapeElem
+TapeElem::operator[](const size_t i) const
+{
+   if (!is_list())
+      return INVALID;
+
+   if (const auto entries = member_index()) {
+      if (i >= size())
+         return INVALID;
+      return TapeElem(words_, strings_, entries[i]);
+   }
+   auto ret = first();
+   for (size_t j = 0; j < i && !!ret; ++j) {
+      ret = ret.next();
+   }
+   return ret;
+}
+
+// -
+
+bool
+Tape::parse(const char* const begin, const char* const end,
+            std::string* const out_err)
+{
+   clear();
+   open_stack_.clear();
+
+   TokenGen tok_gen(begin, end);
+
+   const auto fn_push_scalar = [&](const Token& tok) {
+      const auto type = (tok.type == Token::Type::STRING ? tape::STRING
+                                                         : tape::WORD);
+      words_.push_back(tape::make_word(type, strings_.size()));
+      words_.push_back(uint64_t(tok.end - tok.begin));
+      strings_.append(tok.begin, tok.end);
+   };
+
+   // Reads `"key" :` into the tape, leaving the value's token in `*out_tok`.
+   const auto fn_read_key = [&](Token* const out_tok) {
+      const auto k = tok_gen.NextNonWS();
+      if (k.type != Token::Type::STRING) {
+         *out_err = k.expected_err("STRING");
+         return false;
+      }
+      fn_push_scalar(k);
+
+      const auto colon = tok_gen.NextNonWS();
+      if (!(colon == ":")) {
+         *out_err = colon.expected_err("\":\"");
+         return false;
+      }
+      *out_tok = tok_gen.NextNonWS();
+      return true;
+   };
+
+   // Members are counted on the open word until the container ends.
+   const auto fn_close = [&]() {
+      close_container(open_stack_.back());
+      open_stack_.pop_back();
+   };
+
+   auto tok = tok_gen.NextNonWS();
+   while (true) {
+      // Here, `tok` must start a value.
+      if (tok == "{" || tok == "[") {
+         const bool is_dict = (*tok.begin == '{');
+         if (open_stack_.size()) {
+            words_[open_stack_.back()] += 1;
+         }
+         open_stack_.push_back(words_.size());
+         words_.push_back(tape::make_word(is_dict ? tape::DICT : tape::LIST, 0));
+
+         auto peek_gen = tok_gen;
+         const auto peek = peek_gen.NextNonWS();
+         if (peek == (is_dict ? "}" : "]")) {
+            tok_gen = peek_gen;
+            fn_close();
+         } else {
+            if (is_dict) {
+               if (!fn_read_key(&tok))
+                  return false;
+            } else {
+               tok = tok_gen.NextNonWS();
+            }
+            continue;
+         }
+      } else if (tok.type == Token::Type::STRING ||
+                 tok.type == Token::Type::WORD)
+      {
+         if (open_stack_.size()) {
+            words_[open_stack_.back()] += 1;
+         }
+         fn_push_scalar(tok);
+      } else {
+         *out_err = tok.expected_err(tok.type == Token::Type::MALFORMED
+                                     ? "!MALFORMED" : "VALUE");
+         return false;
+      }
+
+      // After a value, close any containers that end here.
+      while (true) {
+         if (open_stack_.empty()) {
+            words_.push_back(tape::make_word(tape::END, 0));
+            return true;
+         }
+
+         const auto is_dict = (tape::word_type(words_[open_stack_.back()]) ==
+                               tape::DICT);
+         const auto comma = tok_gen.NextNonWS();
+         if (comma == (is_dict ? "}" : "]")) {
+            fn_close();
+            continue;
+         }
+         if (!(comma == ",")) {
+            *out_err = comma.expected_err("\",\"");
+            return false;
+         }
+
+         if (is_dict) {
+            if (!fn_read_key(&tok))
+               return false;
+         } else {
+            tok = tok_gen.NextNonWS();
+         }
+         break;
+      }
+   }
+}
+
+void
+Tape::close_container(const uint64_t open)
+{
+   const auto open_type = tape::word_type(words_[open]);
+   const auto count = tape::word_payload(words_[open]);
+   if (count >= tape::INDEX_MIN_SIZE) {
+      words_.push_back(tape::make_word(tape::INDEX, count));
+      const auto entries = words_.size();
+      auto i = open + 1;
+      while (i != entries - 1) {
+         if (open_type == tape::DICT) {
+            const auto key = strings_.data() + tape::word_payload(words_[i]);
+            const auto inner = key + 1;
+            const auto inner_size = size_t(words_[i + 1]) - 2;
+            const auto hash = memchr(inner, '\\', inner_size)
+                              ? tape::ESCAPED_KEY_HASH
+                              : index_hash(inner, inner + inner_size);
+            words_.push_back((hash << tape::INDEX_POS_BITS) | i);
+            i += 2; // Past the key, to its value.
+         } else {
+            words_.push_back(i);
+         }
+         const auto type = tape::word_type(words_[i]);
+         i = (type == tape::DICT || type == tape::LIST)
+             ? tape::word_payload(words_[i]) : i + 2;
+      }
+      if (open_type == tape::DICT) {
+         std::sort(words_.begin() + entries, words_.end());
+      }
+   }
+   words_.push_back(tape::make_word(
+      open_type == tape::DICT ? tape::DICT_END : tape::LIST_END, count));
+   words_[open] = tape::make_word(open_type, words_.size());
+}
+
+// -
+
+void
+Tape::write_binary(std::ostream* const out) const
+{
+   tape::FileHeader header;
+   header.magic = tape::FILE_MAGIC;
+   header.word_count = words_.size();
+   header.string_size = strings_.size();
+   out->write((const char*)&header, sizeof(header));
+   out->write((const char*)words_.data(), words_.size() * sizeof(words_[0]));
+   out->write(strings_.data(), strings_.size());
+}
+
+/*static*/ std::unique_ptr<MappedTape>
+MappedTape::map_fd(const int fd, const std::string& name,
+                   std::string* const out_err)
+{
+   struct stat info;
+   if (fstat(fd, &info) != 0 ||
+       size_t(info.st_size) < sizeof(tape::FileHeader))
+   {
+      close(fd);
+      *out_err = "Not a tape file: " + name;
+      return nullptr;
+   }
+   const auto size = size_t(info.st_size);
+   const auto addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if (addr == MAP_FAILED) {
+      *out_err = "Can't map " + name + ": " + strerror(errno);
+      return nullptr;
+   }
+
+   std::unique_ptr<MappedTape> ret(new MappedTape);
+   ret->addr_ = addr;
+   ret->size_ = size;
+
+   const auto& header = *(const tape::FileHeader*)addr;
+   const auto words = (const uint64_t*)(&header + 1);
+   const auto words_end = words + header.word_count;
+   if (header.magic != tape::FILE_MAGIC || header.word_count < 3 ||
+       header.word_count > (size - sizeof(header)) / sizeof(uint64_t) ||
+       size - sizeof(header) - header.word_count * sizeof(uint64_t) !=
+          header.string_size ||
+       tape::word_type(words_end[-1]) != tape::END)
+   {
+      *out_err = "Not a tape file, or truncated: " + name;
+      return nullptr;
+   }
+   ret->words_ = words;
+   ret->strings_ = (const char*)words_end;
+   return ret;
+}
+
+/*static*/ std::unique_ptr<MappedTape>
+MappedTape::open(const std::string& path, std::string* const out_err)
+{
+   const auto fd = ::open(path.c_str(), O_RDONLY);
+   if (fd < 0) {
+      *out_err = "Can't open " + path + ": " + strerror(errno);
+      return nullptr;
+   }
+   return map_fd(fd, path, out_err);
+}
+
+/*static*/ std::unique_ptr<MappedTape>
+MappedTape::open_shared(const std::string& name, std::string* const out_err)
+{
+   const auto fd = shm_open(name.c_str(), O_RDONLY, 0);
+   if (fd < 0) {
+      *out_err = "Can't open shared memory " + name + ": " + strerror(errno);
+      return nullptr;
+   }
+   return map_fd(fd, name, out_err);
+}
+
+bool
+publish_shared(const Tape& tape, const std::string& name,
+               std::string* const out_err)
+{
+   // Unlink rather than truncate, so readers mapping the old segment keep it.
+   shm_unlink(name.c_str());
+   const auto fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+   if (fd < 0) {
+      *out_err = "Can't create shared memory " + name + ": " + strerror(errno);
+      return false;
+   }
+   const auto& words = tape.words();
+   const auto& strings = tape.strings();
+   const auto words_size = words.size() * sizeof(words[0]);
+   const auto size = sizeof(tape::FileHeader) + words_size + strings.size();
+   // Allocated rather than just sized, so a full /dev/shm fails here instead
+   // of raising SIGBUS on a store below.
+   const auto alloc_err = posix_fallocate(fd, 0, off_t(size));
+   if (alloc_err) {
+      close(fd);
+      shm_unlink(name.c_str());
+      *out_err = "Can't size shared memory " + name + ": " + strerror(alloc_err);
+      return false;
+   }
+   const auto addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                          fd, 0);
+   const auto map_errno = errno;
+   close(fd);
+   if (addr == MAP_FAILED) {
+      shm_unlink(name.c_str());
+      *out_err = "Can't map " + name + ": " + strerror(map_errno);
+      return false;
+   }
+
+   // The same layout as write_binary(), with the magic written last, so a
+   // reader that opens the segment early is refused rather than misled.
+   const auto header = (tape::FileHeader*)addr;
+   header->magic = 0;
+   header->word_count = words.size();
+   header->string_size = strings.size();
+   memcpy(header + 1, words.data(), words_size);
+   memcpy((char*)(header + 1) + words_size, strings.data(), strings.size());
+   __atomic_store_n(&header->magic, tape::FILE_MAGIC, __ATOMIC_RELEASE);
+   munmap(addr, size);
+   return true;
+}
+
+MappedTape::~MappedTape()
+{
+   munmap(addr_, size_);
+}
+
+// -
+
+void
+Tape::assign(const Val& val)
+{
+   clear();
+   if (!val)
+      return;
+
+   // Size both buffers first, so each is one allocation.
+   size_t word_count = 1; // END
+   size_t string_size = 0;
+   {
+      std::vector<const Val*> pending = {&val};
+      while (pending.size()) {
+         const auto cur = pending.back();
+         pending.pop_back();
+         if (cur->is_val()) {
+            word_count += 2;
+            string_size += cur->val().size();
+            continue;
+         }
+         word_count += 2;
+         const auto count = cur->dict().size() + cur->list().size();
+         if (count >= tape::INDEX_MIN_SIZE) {
+            word_count += 1 + count;
+         }
+         for (const auto& kv : cur->dict()) {
+            word_count += 2;
+            string_size += kv.first.size() + 2; // Escapes may add more.
+            pending.push_back(kv.second.get());
+         }
+         for (const auto& child : cur->list()) {
+            pending.push_back(child.get());
+         }
+      }
+   }
+   words_.reserve(word_count);
+   strings_.reserve(string_size);
+
+   const auto fn_push_text = [&](const uint8_t type, const std::string& text) {
+      words_.push_back(tape::make_word(type, strings_.size()));
+      words_.push_back(text.size());
+      strings_ += text;
+   };
+
+   // Each entry either emits a value, after its key if it has one, or closes
+   // the container whose open word is at `open`.
+   struct Pending final
+   {
+      const Val* val;
+      const std::string* key;
+      uint64_t open;
+   };
+   std::vector<Pending> pending = {{&val, nullptr, 0}};
+   while (pending.size()) {
+      const auto cur = pending.back();
+      pending.pop_back();
+
+      if (!cur.val) {
+         close_container(cur.open);
+         continue;
+      }
+
+      if (cur.key) {
+         fn_push_text(tape::STRING, escape(*cur.key));
+      }
+      const auto& v = *cur.val;
+      if (v.is_val()) {
+         fn_push_text(v.val()[0] == '"' ? tape::STRING : tape::WORD, v.val());
+         continue;
+      }
+
+      // The open word holds the member count until its close word is known.
+      const auto open = uint64_t(words_.size());
+      words_.push_back(tape::make_word(
+         v.is_dict() ? tape::DICT : tape::LIST,
+         v.is_dict() ? v.dict().size() : v.list().size()));
+      pending.push_back({nullptr, nullptr, open});
+
+      // Pushed last-first, so they pop in order. Dicts only iterate forward,
+      // so theirs are reversed once pushed.
+      const auto members_begin = pending.size();
+      for (const auto& kv : v.dict()) {
+         pending.push_back({kv.second.get(), &kv.first, 0});
+      }
+      std::reverse(pending.begin() + members_begin, pending.end());
+      for (auto itr = v.list().rbegin(); itr != v.list().rend(); ++itr) {
+         pending.push_back({itr->get(), nullptr, 0});
+      }
+   }
+   words_.push_back(tape::make_word(tape::END, 0));
+}
+
+Tape
+compact(std::unique_ptr<Val> val)
+{
+   Tape ret;
+   if (val) {
+      ret.assign(*val);
+   }
+   return ret;
+}
+
+} // namespace tjson
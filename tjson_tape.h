@@ -0,0 +1,229 @@
+#ifndef TJSON_TAPE_H
+#define TJSON_TAPE_H
+
+#include "tjson.h"
+
+namespace tjson {
+
+// A read-only document stored as a flat "tape" of 64-bit words plus one string
+// buffer, instead of a tree of heap-allocated Vals.
+//
+// Each word is `type << 56 | payload`:
+// * '{' / '[': payload is the index just past the matching close word, so
+//   skipping a whole container is one load.
+// * '}' / ']': payload is the number of members (keys for a dict).
+// * '"' / 'a': payload is an offset into the string buffer, and the following
+//   word holds the byte length. The bytes are the raw token text, exactly as
+//   Val::val() would hold it. Dict keys are stored the same way.
+// * '#': payload is the member count. Containers with at least
+//   INDEX_MIN_SIZE members have this word between their last member and their
+//   close word, followed by one word per member. For a list, that's each
+//   item's index. For a dict, it's each key's index in the low INDEX_POS_BITS,
+//   under a hash of the key's bytes, sorted so lookups binary search on the
+//   hash, with repeated keys in position order.
+//
+// A document is laid out depth-first, so traversal is a forward walk and
+// building one is append-only.
+namespace tape {
+
+enum Type : uint8_t {
+   DICT = '{',
+   DICT_END = '}',
+   LIST = '[',
+   LIST_END = ']',
+   STRING = '"',
+   WORD = 'a',
+   INDEX = '#',
+   END = '$', // Terminates the tape after the root value.
+};
+
+// Smaller containers are scanned, which is as fast and saves the words.
+const uint64_t INDEX_MIN_SIZE = 8;
+const int INDEX_POS_BITS = 40; // A tape is far fewer words than 2^40.
+const uint64_t INDEX_POS_MASK = (uint64_t(1) << INDEX_POS_BITS) - 1;
+// Keys with escapes can't be hashed without unescaping them, so they share
+// the largest hash, which every lookup also checks.
+const uint64_t ESCAPED_KEY_HASH = (uint64_t(1) << (64 - INDEX_POS_BITS)) - 1;
+
+const uint64_t PAYLOAD_MASK = (uint64_t(1) << 56) - 1;
+
+constexpr uint64_t make_word(const uint8_t type, const uint64_t payload) {
+   return (uint64_t(type) << 56) | payload;
+}
+constexpr uint8_t word_type(const uint64_t word) { return uint8_t(word >> 56); }
+constexpr uint64_t word_payload(const uint64_t word) { return word & PAYLOAD_MASK; }
+
+// The relocatable file format: this header, then the words, then the string
+// bytes. Everything is an offset, so a file can be mapped anywhere. Values are
+// in the writer's byte order, which the magic also checks.
+struct FileHeader final
+{
+   uint64_t magic;
+   uint64_t word_count;
+   uint64_t string_size;
+};
+
+const uint64_t FILE_MAGIC = 0x325041544e534a54; // "TJSNTAP2" little-endian.
+
+} // namespace tape
+
+// A lightweight view of one value in a tape, with accessors mirroring Val's.
+// Elems are only valid while their tape is alive and unmodified.
+class TapeElem final
+{
+   const uint64_t* words_ = nullptr;
+   const char* strings_ = nullptr;
+   uint64_t i_ = 0;
+
+public:
+   static const TapeElem INVALID;
+
+   TapeElem() = default;
+   TapeElem(const uint64_t* const words, const char* const strings,
+            const uint64_t i)
+      : words_(words)
+      , strings_(strings)
+      , i_(i)
+   { }
+
+private:
+   uint8_t type() const { return tape::word_type(words_[i_]); }
+   uint64_t payload() const { return tape::word_payload(words_[i_]); }
+   TapeElem next_or_self() const;
+   // A container's '#' entries, one per member, or nullptr if it has none.
+   const uint64_t* member_index() const;
+
+public:
+   bool operator!() const { return !words_; }
+   bool is_dict() const { return words_ && type() == tape::DICT; }
+   bool is_list() const { return words_ && type() == tape::LIST; }
+   bool is_val() const {
+      return words_ && (type() == tape::STRING || type() == tape::WORD);
+   }
+
+   // Raw token text of a scalar, as in Val::val(). Empty for containers.
+   const char* raw_begin() const {
+      return is_val() ? strings_ + payload() : nullptr;
+   }
+   const char* raw_end() const {
+      return is_val() ? strings_ + payload() + words_[i_ + 1] : nullptr;
+   }
+   std::string val() const { return std::string(raw_begin(), raw_end()); }
+
+   bool as_string(std::string* const out) const {
+      return is_val() && unescape(raw_begin(), raw_end(), out);
+   }
+   bool as_number(double* const out) const {
+      return is_val() && parse_number(raw_begin(), raw_end(), out);
+   }
+
+   // Number of list items or dict keys.
+   size_t size() const;
+
+   // Through the container's index if it has one, so a dict lookup is a
+   // binary search over its key hashes and a list lookup is one load;
+   // otherwise a scan. As with Val, the last of any repeated keys wins.
+   TapeElem operator[](const std::string& x) const;
+   TapeElem operator[](size_t i) const;
+
+   // -
+   // Iteration: For a list, first() is the first item. For a dict, first() is
+   // the first key, and key.next() is its value. next() past the last member
+   // returns INVALID.
+
+   TapeElem first() const;
+   TapeElem next() const;
+
+   // Index of this value's first word in the tape.
+   uint64_t index() const { return i_; }
+};
+
+class Tape final
+{
+   std::vector<uint64_t> words_;
+   std::string strings_;
+   std::vector<uint64_t> open_stack_;
+
+   // Writes the index, if it's big enough for one, and the close word for
+   // the container whose open word, holding its member count, is at `open`.
+   void close_container(uint64_t open);
+
+public:
+   // Reuses the existing buffers, so re-parsing into the same Tape does not
+   // allocate once the buffers are large enough.
+   bool parse(const char* begin, const char* end, std::string* out_err);
+
+   // Lays out `val` depth-first, with its keys and scalars packed into the
+   // string buffer. Both buffers are reserved up front, the words exactly and
+   // the strings before escaping keys, so it's one allocation each unless
+   // keys need escapes. Dict members come in the order Val::dict() iterates
+   // them.
+   void assign(const Val& val);
+
+   void clear() {
+      words_.clear();
+      strings_.clear();
+   }
+
+   TapeElem root() const {
+      if (words_.size() < 2)
+         return TapeElem::INVALID;
+      return TapeElem(words_.data(), strings_.data(), 0);
+   }
+
+   const auto& words() const { return words_; }
+   const auto& strings() const { return strings_; }
+
+   // Writes the file format that MappedTape::open() maps.
+   void write_binary(std::ostream* out) const;
+};
+
+// A tape file mapped read-only, so it's queryable as soon as open() returns,
+// and its pages load lazily and are shared between processes. The file is
+// trusted to come from Tape::write_binary(): open() checks the header and
+// size, but not every offset.
+class MappedTape final
+{
+   void* addr_ = nullptr;
+   size_t size_ = 0;
+   const uint64_t* words_ = nullptr;
+   const char* strings_ = nullptr;
+
+   MappedTape() = default;
+   // Owns the mapping, and is only handed out by unique_ptr.
+   MappedTape(const MappedTape&) = delete;
+   MappedTape& operator=(const MappedTape&) = delete;
+
+   // Takes ownership of `fd`.
+   static std::unique_ptr<MappedTape> map_fd(int fd, const std::string& name,
+                                             std::string* out_err);
+
+public:
+   static std::unique_ptr<MappedTape> open(const std::string& path,
+                                           std::string* out_err);
+
+   // Maps a POSIX shared memory segment made by publish_shared(), so every
+   // process reading it shares one physical copy.
+   static std::unique_ptr<MappedTape> open_shared(const std::string& name,
+                                                  std::string* out_err);
+   ~MappedTape();
+
+   TapeElem root() const { return TapeElem(words_, strings_, 0); }
+};
+
+// Copies `tape` into the POSIX shared memory segment `name` (like "/config"),
+// replacing any existing one, in the file format MappedTape reads. The segment
+// outlives this process until removed with shm_unlink(). Readers that mapped
+// a replaced segment keep it; opening one mid-publish fails, so retry.
+bool publish_shared(const Tape& tape, const std::string& name,
+                    std::string* out_err);
+
+// Moves a long-lived tree out of its scattered per-node allocations into one
+// Tape, and frees the original. Big containers keep an index (see
+// tape::INDEX), so a dict lookup is a binary search and a list item is one
+// load, while traversal stays a forward walk over contiguous members.
+Tape compact(std::unique_ptr<Val> val);
+
+} // namespace tjson
+
+#endif // TJSON_TAPE_H
@@ -0,0 +1,140 @@
+#ifndef TJSON_WALK_H
+#define TJSON_WALK_H
+
+#include "tjson.h"
+
+namespace tjson {
+
+// A stack of bools, for tracking dict-vs-list nesting without allocating
+// until nesting gets very deep.
+class BitStack final
+{
+   static const size_t INLINE_WORDS = 16;
+
+   uint64_t inline_[INLINE_WORDS];
+   std::vector<uint64_t> overflow_;
+   size_t size_ = 0;
+
+   uint64_t& word(const size_t i) {
+      return (i < INLINE_WORDS ? inline_[i] : overflow_[i - INLINE_WORDS]);
+   }
+
+public:
+   bool empty() const { return !size_; }
+   size_t size() const { return size_; }
+
+   void push(const bool x) {
+      const auto i = size_ / 64;
+      if (i >= INLINE_WORDS && i - INLINE_WORDS >= overflow_.size()) {
+         overflow_.push_back(0);
+      }
+      const auto bit = uint64_t(1) << (size_ % 64);
+      auto& w = word(i);
+      w = (x ? w | bit : w & ~bit);
+      size_ += 1;
+   }
+
+   void pop() { size_ -= 1; }
+
+   bool top() {
+      const auto i = size_ - 1;
+      return (word(i / 64) >> (i % 64)) & 1;
+   }
+};
+
+// Walks one value from `tokens`, which can be a TokenGen or a TokenStream,
+// checking its structure like read() does (though a stray symbol is never
+// taken as a scalar), and reporting each token of it to `handler`:
+//
+//    bool OnOpen(const Token& tok);   // "{" or "["
+//    bool OnKey(const Token& tok);    // A dict key, always a STRING.
+//    bool OnScalar(const Token& tok); // A STRING or WORD value.
+//    bool OnClose(const Token& tok);  // "}" or "]"
+//
+// If a handler returns false, the walk stops and returns false, and the
+// handler is responsible for setting `*out_err`. Tokens are only valid during
+// their callback.
+template<typename TokensT, typename HandlerT>
+bool
+walk(TokensT* const tokens, HandlerT* const handler, std::string* const out_err)
+{
+   BitStack is_dict_stack;
+
+   // Reads `"key":`, leaving the token after it in `*out_tok`.
+   const auto fn_key = [&](Token* const out_tok) {
+      const auto k = *out_tok;
+      if (k.type != Token::Type::STRING) {
+         *out_err = k.expected_err("STRING");
+         return false;
+      }
+      if (!handler->OnKey(k))
+         return false;
+
+      const auto colon = tokens->NextNonWS();
+      if (!(colon == ":")) {
+         *out_err = colon.expected_err("\":\"");
+         return false;
+      }
+      *out_tok = tokens->NextNonWS();
+      return true;
+   };
+
+   auto tok = tokens->NextNonWS();
+   while (true) {
+      // Here, `tok` must start a value.
+      if (tok == "{" || tok == "[") {
+         const bool is_dict = (*tok.begin == '{');
+         if (!handler->OnOpen(tok))
+            return false;
+         is_dict_stack.push(is_dict);
+
+         tok = tokens->NextNonWS();
+         if (tok == (is_dict ? "}" : "]")) {
+            is_dict_stack.pop();
+            if (!handler->OnClose(tok))
+               return false;
+         } else {
+            if (is_dict && !fn_key(&tok))
+               return false;
+            continue;
+         }
+      } else if (tok.type == Token::Type::STRING ||
+                 tok.type == Token::Type::WORD)
+      {
+         if (!handler->OnScalar(tok))
+            return false;
+      } else {
+         *out_err = tok.expected_err(tok.type == Token::Type::MALFORMED
+                                     ? "!MALFORMED" : "VALUE");
+         return false;
+      }
+
+      // After a value, close any containers that end here.
+      while (true) {
+         if (is_dict_stack.empty())
+            return true;
+
+         const auto is_dict = is_dict_stack.top();
+         tok = tokens->NextNonWS();
+         if (tok == (is_dict ? "}" : "]")) {
+            is_dict_stack.pop();
+            if (!handler->OnClose(tok))
+               return false;
+            continue;
+         }
+         if (!(tok == ",")) {
+            *out_err = tok.expected_err("\",\"");
+            return false;
+         }
+
+         tok = tokens->NextNonWS();
+         if (is_dict && !fn_key(&tok))
+            return false;
+         break;
+      }
+   }
+}
+
+} // namespace tjson
+
+#endif // TJSON_WALK_H